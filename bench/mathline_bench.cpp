@@ -0,0 +1,747 @@
+//
+//  mathline_bench.cpp
+//  MathLinkBridge
+//
+//  Microbenchmarks for the hot paths of MathLine: the packet loop against a
+//  MockLink, linenoise's history and line editing, and the UTF-8/UTF-32
+//  conversions linenoise does on every keystroke. No kernel is needed.
+//
+//  The harness follows Google Benchmark's conventions so the numbers read the
+//  same way: a benchmark is a function of a State, the clock runs while
+//  State::KeepRunning() returns true, and the iteration count grows until a
+//  run takes at least --min_time seconds. Every run reports wall and CPU time
+//  per iteration; CPU time counts every thread in the process, so it includes
+//  the mock kernel's share.
+//
+//      mathline_bench [--filter=SUBSTRING] [--min_time=SECONDS]
+//                     [--array=ELEMENTS] [--history=ENTRIES] [--line=CHARACTERS]
+//
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <functional>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#ifdef __APPLE__
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+
+#include "popl.hpp"
+#include "mlbridge.h"
+#include "mocklink.h"
+#include "linenoise.h"
+#include "ConvertUTF.h"
+
+//Passed to every benchmark function. Times the iterations and collects what the benchmark reports about them.
+class State{
+public:
+    explicit State(long long iterations): iterations(iterations) {}
+
+    //Counts down the iterations. The clock starts on the first call, so setup before the loop isn't timed.
+    bool KeepRunning(){
+        if(remaining == iterations && !started){
+            started = true;
+            ResumeTiming();
+        }
+        if(remaining-- > 0) return true;
+        PauseTiming();
+        return false;
+    }
+    long long Iterations() const { return iterations; }
+
+    void PauseTiming(){
+        if(!timing) return;
+        wall += Now(CLOCK_MONOTONIC) - wallStarted;
+        cpu += Now(CLOCK_PROCESS_CPUTIME_ID) - cpuStarted;
+        timing = false;
+    }
+    void ResumeTiming(){
+        if(timing) return;
+        wallStarted = Now(CLOCK_MONOTONIC);
+        cpuStarted = Now(CLOCK_PROCESS_CPUTIME_ID);
+        timing = true;
+    }
+
+    //Totals over all iterations, reported as rates.
+    void SetBytesProcessed(long long bytes){ bytesProcessed = bytes; }
+    void SetItemsProcessed(long long items){ itemsProcessed = items; }
+    //Reported as is, for example a count per iteration.
+    void SetCounter(const std::string &name, double value){ counters.emplace_back(name, value); }
+    void SkipWithError(const std::string &message){ error = message; }
+
+    double WallSeconds() const { return wall; }
+    double CPUSeconds() const { return cpu; }
+    long long BytesProcessed() const { return bytesProcessed; }
+    long long ItemsProcessed() const { return itemsProcessed; }
+    const std::vector<std::pair<std::string, double>> &Counters() const { return counters; }
+    const std::string &Error() const { return error; }
+
+private:
+    long long iterations;
+    long long remaining = iterations;
+    bool started = false;
+    bool timing = false;
+    double wallStarted = 0, cpuStarted = 0;
+    double wall = 0, cpu = 0;
+    long long bytesProcessed = 0;
+    long long itemsProcessed = 0;
+    std::vector<std::pair<std::string, double>> counters;
+    std::string error;
+
+    static double Now(clockid_t clock){
+        timespec now;
+        clock_gettime(clock, &now);
+        return now.tv_sec + now.tv_nsec * 1e-9;
+    }
+};
+
+struct Benchmark{
+    std::string name;
+    std::function<void(State &)> function;
+    //Run exactly this many iterations instead of growing the count, for benchmarks that are slow or need a fixed amount of work.
+    long long iterations = 0;
+};
+
+static std::vector<Benchmark> benchmarks;
+
+static void Register(const std::string &name, std::function<void(State &)> function, long long iterations = 0){
+    benchmarks.push_back({name, std::move(function), iterations});
+}
+
+/*
+ Allocation counts. Every operator new and delete in the process goes through these, so a benchmark can count the allocations its work makes and tell whether any are left over.
+ */
+
+static std::atomic<long long> allocations(0);
+static std::atomic<long long> deallocations(0);
+
+void *operator new(std::size_t size){
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if(void *p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void *operator new[](std::size_t size){ return operator new(size); }
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+void *operator new[](std::size_t size, const std::nothrow_t &nothrow) noexcept { return operator new(size, nothrow); }
+void operator delete(void *p) noexcept {
+    if(p == nullptr) return;
+    deallocations.fetch_add(1, std::memory_order_relaxed);
+    std::free(p);
+}
+void operator delete[](void *p) noexcept { operator delete(p); }
+void operator delete(void *p, std::size_t) noexcept { operator delete(p); }
+void operator delete[](void *p, std::size_t) noexcept { operator delete(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { operator delete(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { operator delete(p); }
+
+//Allocations made and not yet freed.
+static long long LiveAllocations(){
+    return allocations.load() - deallocations.load();
+}
+
+/*
+ Mock kernels. Each script answers MLBridge's $PrePrint setup request, then replays the same reply to every request after it.
+ */
+
+static std::string Quote(const std::string &text){
+    std::string quoted = "\"";
+    for(char c : text){
+        if(c == '"' || c == '\\') quoted += '\\';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+//If link is given, it is set to the bridge's MockLink.
+static std::unique_ptr<MLBridge> MockBridge(const std::string &reply, MockLink::Transport transport = MockLink::InProcess, MockLink **link = nullptr){
+    std::istringstream script(
+        "INPUTNAMEPKT \"In[1]:= \"\n"
+        "---\n"
+        "RETURNPKT \"InputForm\"\n"
+        "loop\n" + reply);
+    MockLink *mock = new MockLink(MockScript::Parse(script), transport);
+    std::unique_ptr<MLBridge> bridge(new MLBridge(std::unique_ptr<ILink>(mock)));
+
+    if(link) *link = mock;
+    bridge->Connect();
+    return bridge;
+}
+
+//Discards everything written to it, counting the writes that reach it and noting when the first byte arrived.
+class CountingBuffer: public std::streambuf{
+public:
+    long long writes = 0;
+    long long bytes = 0;
+    std::chrono::steady_clock::time_point firstByte;
+
+protected:
+    int_type overflow(int_type c) override {
+        Count(1);
+        return traits_type::not_eof(c);
+    }
+    std::streamsize xsputn(const char *, std::streamsize n) override {
+        Count(n);
+        return n;
+    }
+
+private:
+    void Count(std::streamsize n){
+        if(bytes == 0) firstByte = std::chrono::steady_clock::now();
+        writes++;
+        bytes += n;
+    }
+};
+
+/*
+ Memory.
+ */
+
+//A field of /proc/self/status in kB, e.g. VmRSS or VmHWM, or -1 where there is no /proc.
+static long StatusKB(const std::string &field){
+    std::ifstream status("/proc/self/status");
+    std::string line;
+
+    while(std::getline(status, line)){
+        if(line.compare(0, field.size() + 1, field + ":") == 0) return std::atol(line.c_str() + field.size() + 1);
+    }
+    return -1;
+}
+
+//The peak resident set size so far, in kB.
+static long PeakRSS(){
+    long peak = StatusKB("VmHWM");
+    if(peak >= 0) return peak;
+
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+/*
+ Runs prepare and then work in a child process, so that neither the benchmarks before it nor the timed iterations count, and reports the child's peak resident set size as peak_rss_kb. Where Linux allows resetting the peak, the growth of the peak during work alone is reported as well, as work_rss_kb.
+ */
+static void MeasurePeakRSS(State &state, const std::function<void()> &prepare, const std::function<void()> &work){
+    int fds[2];
+    long measured[2] = {-1, -1};
+
+    if(pipe(fds) == -1) return;
+    fflush(stdout);
+    std::cout.flush();
+    pid_t child = fork();
+    if(child == 0){
+        close(fds[0]);
+        long before = -1;
+        try {
+            prepare();
+            std::ofstream clear("/proc/self/clear_refs");
+            //5 resets the peak to the current resident set size.
+            if(clear << "5" << std::flush) before = StatusKB("VmRSS");
+            clear.close();
+            work();
+            measured[0] = PeakRSS();
+            if(before >= 0) measured[1] = measured[0] - before;
+        } catch (MLBridgeException &) {
+            //Reported as unmeasured.
+        }
+        ssize_t written = write(fds[1], measured, sizeof(measured));
+        _exit(written == sizeof(measured) ? 0 : 1);
+    }
+    close(fds[1]);
+    if(child > 0){
+        if(read(fds[0], measured, sizeof(measured)) != sizeof(measured)) measured[0] = -1;
+        waitpid(child, nullptr, 0);
+    }
+    close(fds[0]);
+
+    if(measured[0] < 0){
+        state.SkipWithError("could not measure the peak resident set size");
+        return;
+    }
+    state.SetCounter("peak_rss_kb", (double)measured[0]);
+    if(measured[1] >= 0) state.SetCounter("work_rss_kb", (double)measured[1]);
+}
+
+/*
+ The packet loop.
+ */
+
+//GetEvaluated copies a string result of the given size out of the link.
+static void GetEvaluatedString(State &state, size_t size){
+    auto bridge = MockBridge("---\nRETURNPKT " + Quote(std::string(size, 'a')) + "\n");
+    size_t bytes = 0;
+
+    while(state.KeepRunning()) bytes += bridge->GetEvaluated("f[x]").size();
+    state.SetBytesProcessed(bytes);
+}
+
+//A large text result written to the output, whole or in streamBufferSize pieces. Reports how long it took for the first byte to reach the output, and the memory one evaluation takes in a fresh process.
+static void StreamResult(State &state, int streamBufferSize){
+    const std::string reply =
+        "---\n"
+        "OUTPUTNAMEPKT \"Out[1]= \"\n"
+        "RETURNTEXTPKT " + Quote(std::string(1 << 20, 'a')) + "\n"
+        "INPUTNAMEPKT \"In[2]:= \"\n";
+    CountingBuffer counter;
+    std::ostream out(&counter);
+    double firstByte = 0;
+
+    //The mock kernel has the reply in memory before the evaluation starts, so work_rss_kb is what MathLine itself adds to it.
+    std::unique_ptr<MLBridge> bridge;
+    MeasurePeakRSS(state, [&]{
+        bridge = MockBridge(reply);
+        bridge->streamBufferSize = streamBufferSize;
+    }, [&]{
+        bridge->EvaluateTo("f[x]", out);
+    });
+    if(!state.Error().empty()) return;
+
+    bridge = MockBridge(reply);
+    bridge->streamBufferSize = streamBufferSize;
+    while(state.KeepRunning()){
+        auto started = std::chrono::steady_clock::now();
+        counter.bytes = 0;
+        bridge->EvaluateTo("f[x]", out);
+        firstByte += std::chrono::duration<double, std::micro>(counter.firstByte - started).count();
+    }
+    state.SetBytesProcessed(state.Iterations() * (1 << 20));
+    state.SetCounter("first_byte_us", firstByte / state.Iterations());
+}
+
+//The allocations the mock kernel itself makes per evaluation of input: building the request, keeping a record of it and delivering the reply. Found by sending the same request straight to link and discarding the reply unread.
+static double MockAllocations(MockLink *link, const std::string &input, int rounds){
+    long long before = allocations.load();
+
+    for(int i = 0; i < rounds; i++){
+        link->PutFunction("EnterTextPacket", 1);
+        link->PutUTF8String((const unsigned char *)input.data(), (int)input.size());
+        link->EndPacket();
+        while(link->Ready()){
+            link->NextPacket();
+            link->NewPacket();
+        }
+        link->Kernel().ForgetRequests();
+    }
+    return (double)(allocations.load() - before) / rounds;
+}
+
+//A syntax error: the message, its text and the syntax packet, cached by ReceivedMessagePacket and printed by PrintMessages. Reports the allocations MathLine makes for each message once the cache is warm, not counting the mock kernel's, and how many allocations are still live once the bridge is gone, which should be none.
+static void SyntaxMessages(State &state){
+    long long liveBefore = LiveAllocations();
+    MockLink *link;
+    auto bridge = MockBridge(
+        "---\n"
+        "MESSAGEPKT Syntax \"sntxf\"\n"
+        "TEXTPKT \"Syntax::sntxf: \\\"1+\\\" cannot be followed by \\\"*2\\\".\"\n"
+        "SYNTAXPKT 3\n"
+        "INPUTNAMEPKT \"In[1]:= \"\n", MockLink::InProcess, &link);
+    CountingBuffer counter;
+    std::ostream out(&counter);
+
+    //The first message fills the cache.
+    bridge->EvaluateTo("1+*2", out);
+    long long allocated = allocations.load();
+    while(state.KeepRunning()){
+        bridge->EvaluateTo("1+*2", out);
+        link->Kernel().ForgetRequests();
+    }
+    allocated = allocations.load() - allocated;
+    double mockAllocations = MockAllocations(link, "1+*2", 10000);
+    bridge.reset();
+    long long outstanding = LiveAllocations() - liveBefore;
+
+    state.SetCounter("allocs_per_message", (double)allocated / state.Iterations() - mockAllocations);
+    state.SetCounter("outstanding_allocs", (double)outstanding);
+}
+
+//A graphic sent as chunks of display packets, accumulated into an image and recycled the way a caller drains MLBridge::images. Memory must stay flat from one image to the next: the growth of the resident set size over the run is reported as rss_growth_kb, and more than an image's worth fails the benchmark.
+static void AccumulateImage(State &state, int chunks){
+    const std::string chunk(4096, '%');
+    std::string reply = "---\n";
+    for(int i = 0; i < chunks; i++) reply += "DISPLAYPKT " + Quote(chunk) + "\n";
+    reply += "DISPLAYENDPKT \"\"\nOUTPUTNAMEPKT \"Out[1]= \"\nRETURNTEXTPKT \"-Graphics-\"\nINPUTNAMEPKT \"In[2]:= \"\n";
+
+    MockLink *link;
+    auto bridge = MockBridge(reply, MockLink::InProcess, &link);
+    CountingBuffer counter;
+    std::ostream out(&counter);
+    size_t bytes = 0;
+    auto drain = [&]{
+        while(!bridge->images.empty()){
+            bytes += bridge->images.front().size();
+            bridge->RecycleImage(std::move(bridge->images.front()));
+            bridge->images.pop();
+        }
+        //Otherwise the mock kernel's record of requests would be the growth we measure.
+        link->Kernel().ForgetRequests();
+    };
+
+    //The first image allocates the buffer that every later one reuses.
+    bridge->EvaluateTo("Plot[x, {x, 0, 1}]", out);
+    drain();
+    bytes = 0;
+    long before = StatusKB("VmRSS");
+    while(state.KeepRunning()){
+        bridge->EvaluateTo("Plot[x, {x, 0, 1}]", out);
+        drain();
+    }
+    long after = StatusKB("VmRSS");
+    state.SetBytesProcessed(bytes);
+    if(before < 0 || after < 0) return;
+
+    long growth = after - before;
+    state.SetCounter("rss_growth_kb", (double)growth);
+    if(growth > chunks * (long)chunk.size() / 1024){
+        state.SkipWithError("memory grew by " + std::to_string(growth) + " kB over " + std::to_string(state.Iterations()) + " images");
+    }
+}
+
+//A batch of short results, counting the writes that reach the output with the given outputBufferSize.
+static void BatchWrites(State &state, int outputBufferSize){
+    const int inputs = 1000;
+    auto bridge = MockBridge(
+        "---\n"
+        "OUTPUTNAMEPKT \"Out[1]= \"\n"
+        "RETURNTEXTPKT \"42\"\n"
+        "INPUTNAMEPKT \"In[2]:= \"\n");
+    CountingBuffer counter;
+    std::ostream out(&counter);
+    std::string text;
+
+    for(int i = 0; i < inputs; i++) text += "f[" + std::to_string(i) + "]\n";
+    bridge->pcout = &out;
+    bridge->outputBufferSize = outputBufferSize;
+    while(state.KeepRunning()) bridge->Batch(std::string_view(text));
+    state.SetItemsProcessed(state.Iterations() * inputs);
+    state.SetCounter("writes_per_input", (double)counter.writes / (state.Iterations() * inputs));
+}
+
+//A kernel that takes 20 ms to answer. The CPU time shows what waiting costs.
+static void WaitForReply(State &state, bool blockingWait){
+    auto bridge = MockBridge(
+        "--- 20\n"
+        "OUTPUTNAMEPKT \"Out[1]= \"\n"
+        "RETURNTEXTPKT \"42\"\n"
+        "INPUTNAMEPKT \"In[2]:= \"\n", MockLink::SocketPair);
+    CountingBuffer counter;
+    std::ostream out(&counter);
+
+    bridge->blockingWait = blockingWait;
+    while(state.KeepRunning()) bridge->EvaluateTo("Pause[0.02]", out);
+}
+
+static long long arrayElements = 1000000;
+
+//Assigning a vector of reals in the kernel: as a packed array, or formatted as an input string the way it had to be done before PutArray.
+static void PutRealArray(State &state, bool packed){
+    auto bridge = MockBridge("---\nRETURNPKT \"Null\"\n");
+    std::vector<double> data(arrayElements);
+
+    for(long long i = 0; i < arrayElements; i++) data[i] = i * 0.001;
+    while(state.KeepRunning()){
+        if(packed){
+            bridge->PutArray("data", data.data(), {(int)arrayElements});
+            continue;
+        }
+        std::string input = "data = {";
+        char number[32];
+        for(long long i = 0; i < arrayElements; i++){
+            if(i) input += ", ";
+            input.append(number, snprintf(number, sizeof(number), "%.17g", data[i]));
+        }
+        input += "};";
+        bridge->GetEvaluated(input);
+    }
+    state.SetBytesProcessed(state.Iterations() * arrayElements * sizeof(double));
+}
+
+/*
+ linenoise.
+ */
+
+static long long historyEntries = 1000000;
+
+//Adding a line to a full history, which evicts the oldest entry.
+static void AddHistory(State &state){
+    std::vector<std::string> lines;
+
+    for(int i = 0; i < 1000; i++) lines.push_back("Integrate[x^" + std::to_string(i) + ", x]");
+    linenoiseHistorySetMaxLen((int)historyEntries);
+    for(long long i = 0; i < historyEntries; i++) linenoiseHistoryAdd(lines[i % lines.size()].c_str());
+
+    long long i = 0;
+    while(state.KeepRunning()) linenoiseHistoryAdd(lines[i++ % lines.size()].c_str());
+    linenoiseHistoryFree();
+    state.SetItemsProcessed(state.Iterations());
+}
+
+//Halving a full history that has wrapped around, as SetMaxHistory does when --maxhistory is lowered.
+static void ResizeHistory(State &state){
+    while(state.KeepRunning()){
+        state.PauseTiming();
+        linenoiseHistorySetMaxLen((int)historyEntries);
+        for(long long i = 0; i < historyEntries + historyEntries / 3; i++) linenoiseHistoryAdd(std::to_string(i).c_str());
+        state.ResumeTiming();
+        linenoiseHistorySetMaxLen((int)(historyEntries / 2));
+        state.PauseTiming();
+        linenoiseHistoryFree();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.Iterations() * historyEntries);
+}
+
+/*
+ Types keys into linenoise on a pseudo terminal, one line per iteration, so that the benchmark sees what a user would. stdin and stdout are redirected to the terminal for the duration.
+ */
+static void TypeKeys(State &state, const std::string &keys){
+    int master, slave;
+    winsize size = {24, 80, 0, 0};
+
+    if(openpty(&master, &slave, nullptr, nullptr, &size) == -1){
+        state.SkipWithError("openpty failed");
+        return;
+    }
+    fflush(stdout);
+    int savedIn = dup(STDIN_FILENO), savedOut = dup(STDOUT_FILENO);
+    dup2(slave, STDIN_FILENO);
+    dup2(slave, STDOUT_FILENO);
+    setenv("TERM", "xterm", 1);
+
+    //The terminal's side: reads whatever linenoise draws so that it never blocks, and types once the prompt is up. linenoise flushes anything typed before it switches the terminal to raw mode.
+    std::atomic<bool> drawn(false);
+    std::thread screen([&]{
+        char buffer[65536];
+        while(read(master, buffer, sizeof(buffer)) > 0) drawn = true;
+    });
+
+    while(state.KeepRunning()){
+        state.PauseTiming();
+        //Let the screen catch up with the previous line.
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        drawn = false;
+        std::thread keyboard([&]{
+            while(!drawn.load()) std::this_thread::sleep_for(std::chrono::microseconds(100));
+            for(size_t written = 0; written < keys.size();){
+                ssize_t n = write(master, keys.data() + written, keys.size() - written);
+                if(n <= 0) break;
+                written += n;
+            }
+        });
+        state.ResumeTiming();
+        free(linenoise("In[1]:= "));
+        keyboard.join();
+    }
+
+    fflush(stdout);
+    dup2(savedOut, STDOUT_FILENO);
+    dup2(savedIn, STDIN_FILENO);
+    close(savedOut);
+    close(savedIn);
+    close(slave);
+    screen.join();
+    close(master);
+    state.SetItemsProcessed(state.Iterations() * keys.size());
+}
+
+static long long lineLength = 1000;
+
+//Typing a line. linenoise redraws the line with refreshLine after every keystroke, so this measures refreshLine as the line grows to lineLength characters.
+static void TypeLine(State &state){
+    TypeKeys(state, std::string(lineLength, 'x') + "\r");
+}
+
+//Ctrl-R and a search for the oldest line of a full history, which every other line nearly matches.
+static void SearchHistory(State &state){
+    linenoiseHistorySetMaxLen((int)historyEntries);
+    for(long long i = 0; i < historyEntries; i++) linenoiseHistoryAdd(("Integrate[x^" + std::to_string(i) + ", x]").c_str());
+    TypeKeys(state, "\x12x^0, x]\r");
+    linenoiseHistoryFree();
+}
+
+//Mathematica input is mostly ASCII with the occasional named character.
+static std::string SampleText(size_t size){
+    const std::string pieces[] = {"Integrate[Sin[x]^2, {x, 0, Pi}] ", "α + β ", "∫ f ", "x → ∞ "};
+    std::string text;
+
+    for(size_t i = 0; text.size() < size; i++) text += pieces[i % 4];
+    return text;
+}
+
+static void UTF8ToUTF32(State &state){
+    using namespace linenoise_ng;
+    std::string text = SampleText(1 << 20);
+    std::vector<UTF32> converted(text.size());
+
+    while(state.KeepRunning()){
+        const UTF8 *source = (const UTF8 *)text.data();
+        UTF32 *target = converted.data();
+        ConvertUTF8toUTF32(&source, source + text.size(), &target, target + converted.size(), lenientConversion);
+    }
+    state.SetBytesProcessed(state.Iterations() * text.size());
+}
+
+static void UTF32ToUTF8(State &state){
+    using namespace linenoise_ng;
+    std::string text = SampleText(1 << 20);
+    std::vector<UTF32> wide(text.size());
+    std::string converted(text.size(), '\0');
+
+    const UTF8 *source = (const UTF8 *)text.data();
+    UTF32 *end = wide.data();
+    ConvertUTF8toUTF32(&source, source + text.size(), &end, end + wide.size(), lenientConversion);
+    while(state.KeepRunning()){
+        const UTF32 *from = wide.data();
+        UTF8 *target = (UTF8 *)&converted[0];
+        ConvertUTF32toUTF8(&from, end, &target, target + converted.size(), lenientConversion);
+    }
+    state.SetBytesProcessed(state.Iterations() * text.size());
+}
+
+static void RegisterBenchmarks(){
+    for(size_t size : {16, 64 * 1024, 1024 * 1024}){
+        Register("GetEvaluated/String/" + std::to_string(size), [=](State &state){ GetEvaluatedString(state, size); });
+    }
+    for(int bufferSize : {0, 64 * 1024}){
+        Register("EvaluateTo/Stream/" + std::to_string(bufferSize), [=](State &state){ StreamResult(state, bufferSize); });
+    }
+    Register("EvaluateTo/SyntaxMessages", SyntaxMessages);
+    Register("EvaluateTo/Image/64x4K", [](State &state){ AccumulateImage(state, 64); });
+    for(int bufferSize : {0, 64 * 1024}){
+        Register("Batch/Writes/" + std::to_string(bufferSize), [=](State &state){ BatchWrites(state, bufferSize); });
+    }
+    Register("Wait/Blocking", [](State &state){ WaitForReply(state, true); }, 25);
+    Register("Wait/Polling", [](State &state){ WaitForReply(state, false); }, 25);
+    Register("PutArray/Packed/" + std::to_string(arrayElements), [](State &state){ PutRealArray(state, true); });
+    Register("PutArray/String/" + std::to_string(arrayElements), [](State &state){ PutRealArray(state, false); });
+    Register("linenoise/HistoryAdd/" + std::to_string(historyEntries), AddHistory);
+    Register("linenoise/HistorySetMaxLen/" + std::to_string(historyEntries), ResizeHistory);
+    Register("linenoise/TypeLine/" + std::to_string(lineLength), TypeLine, 1);
+    Register("linenoise/HistorySearch/" + std::to_string(historyEntries), SearchHistory, 5);
+    Register("ConvertUTF/UTF8ToUTF32/1M", UTF8ToUTF32);
+    Register("ConvertUTF/UTF32ToUTF8/1M", UTF32ToUTF8);
+}
+
+static std::string Rate(double perSecond, const char *unit){
+    const char *prefixes[] = {"", "k", "M", "G", "T"};
+    int prefix = 0;
+    std::ostringstream out;
+
+    while(perSecond >= 1000 && prefix < 4){
+        perSecond /= 1000;
+        prefix++;
+    }
+    out << std::fixed << std::setprecision(perSecond < 10 ? 2 : 1) << perSecond << prefixes[prefix] << unit << "/s";
+    return out.str();
+}
+
+static void Run(const Benchmark &benchmark, double minTime){
+    long long iterations = benchmark.iterations ? benchmark.iterations : 1;
+
+    for(;;){
+        State state(iterations);
+
+        try {
+            benchmark.function(state);
+        } catch (MLBridgeException &e) {
+            state.SkipWithError(e.ToString());
+        }
+        if(!state.Error().empty()){
+            std::cout << std::left << std::setw(36) << benchmark.name << " ERROR: " << state.Error() << std::endl;
+            return;
+        }
+
+        double seconds = state.WallSeconds();
+        if(!benchmark.iterations && seconds < minTime && iterations < 1000000000){
+            //Aim a little past minTime so the next run is the last, as Google Benchmark does.
+            double multiplier = seconds > 0 ? minTime * 1.4 / seconds : 10;
+            iterations = std::max(iterations + 1, (long long)(iterations * std::min(multiplier, 10.0)));
+            continue;
+        }
+
+        std::cout << std::left << std::setw(36) << benchmark.name << std::right << std::fixed << std::setprecision(0)
+            << std::setw(14) << seconds * 1e9 / iterations << " ns"
+            << std::setw(14) << state.CPUSeconds() * 1e9 / iterations << " ns"
+            << std::setw(12) << iterations;
+        if(state.BytesProcessed()) std::cout << "  bytes=" << Rate(state.BytesProcessed() / seconds, "B");
+        if(state.ItemsProcessed()) std::cout << "  items=" << Rate(state.ItemsProcessed() / seconds, "");
+        for(auto &counter : state.Counters()){
+            std::cout << "  " << counter.first << "=";
+            //Whole numbers, such as sizes, in full.
+            if(counter.second == (long long)counter.second) std::cout << (long long)counter.second;
+            else std::cout << std::defaultfloat << std::setprecision(3) << counter.second;
+        }
+        std::cout << std::endl;
+        return;
+    }
+}
+
+int main(int argc, const char *argv[]){
+    std::string filter;
+    double minTime = 0.5;
+
+    popl::Switch helpOption("h", "help", "Produce help message.");
+    popl::Value<std::string> filterOption("", "filter", "String. Run only the benchmarks whose name\ncontains this.", "", &filter);
+    popl::Value<double> mintimeOption("", "min_time", "Number. Run each benchmark for at least this\nmany seconds. Defaults to 0.5.", minTime, &minTime);
+    popl::Value<long long> arrayOption("", "array", "Integer. The number of elements in the\nPutArray benchmarks. Defaults to 1000000.", arrayElements, &arrayElements);
+    popl::Value<long long> historyOption("", "history", "Integer. The number of history entries in the\nhistory benchmarks. Defaults to 1000000.", historyEntries, &historyEntries);
+    popl::Value<long long> lineOption("", "line", "Integer. The number of characters typed in the\nTypeLine benchmark. Defaults to 1000.", lineLength, &lineLength);
+
+    popl::OptionParser op("mathline_bench Usage");
+    op.add(helpOption)
+            .add(filterOption)
+            .add(mintimeOption)
+            .add(arrayOption)
+            .add(historyOption)
+            .add(lineOption);
+
+    try{
+        op.parse(argc, argv);
+    }catch (std::invalid_argument &e){
+        std::cout << "Error: " << e.what() << ".\n";
+        std::cout << op << std::endl;
+        return 1;
+    };
+    if(!op.unknownOptions().empty() || helpOption.isSet()){
+        for(const auto &n : op.unknownOptions())
+            std::cout << "Unknown option: " << n << "\n";
+        std::cout << op << std::endl;
+        return op.unknownOptions().empty() ? 0 : 1;
+    }
+    if(lineLength < 1 || lineLength > 4000){
+        std::cerr << "Option line must be between 1 and 4000, the longest line linenoise accepts." << std::endl;
+        return 1;
+    }
+
+    RegisterBenchmarks();
+    std::cout << std::left << std::setw(36) << "Benchmark" << std::right << std::setw(17) << "Time" << std::setw(17) << "CPU"
+        << std::setw(12) << "Iterations" << "\n" << std::string(82, '-') << std::endl;
+    for(auto &benchmark : benchmarks){
+        if(benchmark.name.find(filter) == std::string::npos) continue;
+        Run(benchmark, minTime);
+    }
+    return 0;
+}
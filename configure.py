@@ -47,6 +47,18 @@ output_file = "MathLine"
 source_files = [
     "main.cpp",
     "mlbridge.cpp",
+    "wstplink.cpp",
+    "mocklink.cpp",
+    "scanner.cpp",
+    "kernelpool.cpp",
+    "daemon.cpp",
+    "imagesink.cpp",
+    "jsonrecord.cpp",
+    "expression.cpp",
+    "mappedfile.cpp",
+    "resultcache.cpp",
+    "packetstats.cpp",
+    "tracer.cpp",
     "linenoise.c"
 ]
 
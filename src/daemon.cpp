@@ -0,0 +1,264 @@
+//
+//  daemon.cpp
+//  MathLinkBridge
+//
+
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <exception>
+#include <sstream>
+#include <streambuf>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+#include "jsonrecord.h"
+#include "scanner.h"
+
+//How long a client may take to send its input, and to take each piece of its output. Clients are served one at a time, so one that stalls would otherwise hold up everyone else.
+static const int clientTimeoutSeconds = 10;
+
+//Waits until fd is ready for events or deadline passes. Returns false on timeout or error.
+static bool WaitUntil(int fd, short events, std::chrono::steady_clock::time_point deadline){
+    while(true){
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if(remaining <= 0) return false;
+        pollfd pfd{fd, events, 0};
+        int ready = poll(&pfd, 1, (int)remaining);
+        if(ready > 0) return true;
+        if(ready == 0 || errno != EINTR) return false;
+    }
+}
+
+//Lets the kernel's output go straight to the client through the usual std::ostream machinery. A client that doesn't take a buffer's worth of output within clientTimeoutSeconds is given up on, and the rest of its output is dropped.
+class SocketBuffer: public std::streambuf{
+public:
+    explicit SocketBuffer(int fd): fd(fd){
+        setp(buffer, buffer + sizeof buffer);
+    }
+    ~SocketBuffer() override{
+        sync();
+    }
+
+    //Whether the client stopped taking output or went away.
+    bool Failed() const { return failed; }
+
+protected:
+    int_type overflow(int_type c) override{
+        if(sync() != 0) return traits_type::eof();
+        if(!traits_type::eq_int_type(c, traits_type::eof())){
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override{
+        const char *data = pbase();
+        size_t size = failed ? 0 : (size_t)(pptr() - pbase());
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(clientTimeoutSeconds);
+        while(size > 0){
+            //MSG_NOSIGNAL: a client that went away is not a reason for the daemon to die of SIGPIPE. MSG_DONTWAIT: we do the waiting, against the deadline.
+            ssize_t n = send(fd, data, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if(n < 0 && errno == EINTR) continue;
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && WaitUntil(fd, POLLOUT, deadline)) continue;
+            if(n <= 0){
+                //Drop the rest. We still have to finish reading the kernel's response.
+                failed = true;
+                break;
+            }
+            data += n;
+            size -= (size_t)n;
+        }
+        setp(buffer, buffer + sizeof buffer);
+        return 0;
+    }
+
+private:
+    int fd;
+    bool failed = false;
+    char buffer[64 * 1024];
+};
+
+static bool MakeAddress(const std::string &socketPath, sockaddr_un &address){
+    std::memset(&address, 0, sizeof address);
+    address.sun_family = AF_UNIX;
+    if(socketPath.size() >= sizeof address.sun_path) return false;
+    std::strcpy(address.sun_path, socketPath.c_str());
+    return true;
+}
+
+//Reads everything the client sends until it shuts down its end. Returns false if the client takes longer than clientTimeoutSeconds in all, or the connection fails.
+static bool ReadRequest(int fd, std::string &request){
+    char buffer[4096];
+    ssize_t n;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(clientTimeoutSeconds);
+
+    while(true){
+        if(!WaitUntil(fd, POLLIN, deadline)) return false;
+        n = read(fd, buffer, sizeof buffer);
+        if(n == 0) return true;
+        if(n < 0){
+            if(errno == EINTR) continue;
+            return false;
+        }
+        request.append(buffer, (size_t)n);
+    }
+}
+
+//Clears the way for our socket. A socket left behind by a previous daemon is removed, but not one another daemon is still listening on, and never anything that isn't a socket.
+static void RemoveStaleSocket(const std::string &socketPath, const sockaddr_un &address){
+    struct stat status;
+
+    if(lstat(socketPath.c_str(), &status) != 0) return;
+    if(!S_ISSOCK(status.st_mode)){
+        throw MLBridgeException("Cannot listen on " + socketPath + ": the path exists and is not a socket.");
+    }
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool live = probe >= 0 && connect(probe, (const sockaddr *)&address, sizeof address) == 0;
+    if(probe >= 0) close(probe);
+    if(live){
+        throw MLBridgeException("Cannot listen on " + socketPath + ": another daemon is already listening there.");
+    }
+    unlink(socketPath.c_str());
+}
+
+void ServeDaemon(MLBridge &bridge, const std::string &socketPath){
+    sockaddr_un address;
+    int listener;
+    bool quit = false;
+
+    if(!MakeAddress(socketPath, address)){
+        throw MLBridgeException("Socket path is too long: " + socketPath);
+    }
+    //A previous daemon may have left its socket behind.
+    RemoveStaleSocket(socketPath, address);
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0){
+        throw MLBridgeException("Cannot create socket: " + std::string(std::strerror(errno)));
+    }
+    //Anyone who can connect can run code as us, so only we may: the socket is created under umask 077, whatever umask we were started with.
+    mode_t previousMask = umask(077);
+    int bound = bind(listener, (sockaddr *)&address, sizeof address);
+    umask(previousMask);
+    if(bound != 0 || listen(listener, 16) != 0){
+        std::string error = std::strerror(errno);
+        close(listener);
+        throw MLBridgeException("Cannot listen on " + socketPath + ": " + error);
+    }
+
+    try {
+        while(!quit){
+            int client = accept(listener, nullptr, nullptr);
+            if(client < 0){
+                if(errno == EINTR) continue;
+                throw MLBridgeException("Cannot accept connection: " + std::string(std::strerror(errno)));
+            }
+
+            std::string request;
+            bool json = bridge.protocol == MLBridge::JSONLinesProtocol;
+            //Set if the kernel died with no standby to take over, to be rethrown once we're done with this client.
+            std::exception_ptr fatal;
+            {
+                SocketBuffer buffer(client);
+                std::ostream out(&buffer);
+                std::string expression;
+
+                if(!ReadRequest(client, request)){
+                    const char *message = "MathLine daemon: timed out waiting for the end of the input.";
+                    if(json){
+                        JSONRecord(out, "error").AddString("text", message).AddInteger("code", 0);
+                    } else{
+                        out << message << std::endl;
+                    }
+                    request.clear();
+                }
+                std::istringstream in(request);
+                try {
+                    //A client that stopped taking output gets no more of it, so don't evaluate the rest of its input for nothing.
+                    while(!buffer.Failed() && ReadExpression(in, expression)){
+                        if(expression == "Exit" || expression == "Exit[]" || expression == "Quit"){
+                            quit = true;
+                            break;
+                        }
+                        bridge.EvaluateTo(expression, out);
+                        out.flush();
+                    }
+                } catch (MLBridgeException &e) {
+                    //Tell the client what happened before we go down with the kernel.
+                    if(json){
+                        JSONRecord(out, "error").AddString("text", e.ToString()).AddInteger("code", e.errorCode);
+                    } else{
+                        out << e.ToString() << std::endl;
+                    }
+                    if(bridge.SwitchToStandby()){
+                        //The rest of this client's input may depend on what the dead kernel knew, so we drop it.
+                        if(json){
+                            JSONRecord(out, "standby");
+                        } else{
+                            out << "Switched to the standby kernel. The session history has been lost." << std::endl;
+                        }
+                    } else{
+                        fatal = std::current_exception();
+                    }
+                }
+            }
+            close(client);
+            if(fatal) std::rethrow_exception(fatal);
+        }
+    } catch (MLBridgeException &) {
+        close(listener);
+        unlink(socketPath.c_str());
+        throw;
+    }
+
+    close(listener);
+    unlink(socketPath.c_str());
+}
+
+bool RunDaemonClient(const std::string &socketPath, std::istream &in, std::ostream &out){
+    sockaddr_un address;
+    std::string request;
+    char buffer[64 * 1024];
+    ssize_t n;
+
+    if(!MakeAddress(socketPath, address)) return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) return false;
+    if(connect(fd, (sockaddr *)&address, sizeof address) != 0){
+        close(fd);
+        return false;
+    }
+
+    //Send the whole input, then let the daemon know that's all there is.
+    std::ostringstream input;
+    input << in.rdbuf();
+    request = input.str();
+    const char *data = request.data();
+    size_t size = request.size();
+    while(size > 0){
+        n = send(fd, data, size, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) break;
+        data += n;
+        size -= (size_t)n;
+    }
+    shutdown(fd, SHUT_WR);
+
+    //Pass the output along as it arrives.
+    while((n = read(fd, buffer, sizeof buffer)) != 0){
+        if(n < 0){
+            if(errno == EINTR) continue;
+            break;
+        }
+        out.write(buffer, n);
+        out.flush();
+    }
+    close(fd);
+    return true;
+}
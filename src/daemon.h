@@ -0,0 +1,33 @@
+//
+//  daemon.h
+//  MathLinkBridge
+//
+//  Keeps one warmed up kernel available behind a Unix domain socket, so that
+//  short jobs don't pay for a kernel launch every time.
+//
+//  The protocol is as simple as it gets. A client connects, writes its
+//  input, and shuts down its end of the connection for writing. The daemon
+//  evaluates every complete expression in the input, one after another,
+//  writing whatever the kernel prints back to the client as it goes, and then
+//  closes the connection. Clients are served one at a time, so a client that
+//  takes more than 10 seconds to send all of its input gets an error, and one
+//  that stops taking its output for 10 seconds is cut off, instead of holding
+//  up everyone else. Errors are JSON records if the bridge uses the JSON Lines
+//  protocol. An input of Exit, Exit[] or Quit
+//  shuts the daemon down. If the kernel dies and the bridge keeps a standby
+//  kernel, the daemon carries on with that.
+//
+
+#pragma once
+
+#include <string>
+#include <istream>
+#include <ostream>
+
+#include "mlbridge.h"
+
+//Serves bridge, which must already be connected, on socketPath until a client asks us to quit. The socket is only accessible to the user running the daemon, since clients can run arbitrary code in the kernel. A stale socket at socketPath is replaced, but anything else there is left alone. Throws MLBridgeException if the socket can't be set up or the kernel dies.
+void ServeDaemon(MLBridge &bridge, const std::string &socketPath);
+
+//Sends everything read from in to the daemon listening on socketPath and copies the reply to out. Returns false if the daemon can't be reached.
+bool RunDaemonClient(const std::string &socketPath, std::istream &in, std::ostream &out);
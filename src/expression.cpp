@@ -0,0 +1,110 @@
+//
+//  expression.cpp
+//  MathLinkBridge
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <utility>
+
+#include "expression.h"
+
+MLExpression MLExpression::MakeInteger(long long value){
+    MLExpression e;
+    e.kind = Integer;
+    e.integer = value;
+    return e;
+}
+
+MLExpression MLExpression::MakeReal(double value){
+    MLExpression e;
+    e.kind = Real;
+    e.real = value;
+    return e;
+}
+
+MLExpression MLExpression::MakeString(std::string value){
+    MLExpression e;
+    e.kind = String;
+    e.text = std::move(value);
+    return e;
+}
+
+MLExpression MLExpression::MakeSymbol(std::string name){
+    MLExpression e;
+    e.kind = Symbol;
+    e.text = std::move(name);
+    return e;
+}
+
+bool MLExpression::HasHead(const char *name) const{
+    return kind == Normal && !parts.empty() && parts.front().kind == Symbol && parts.front().text == name;
+}
+
+std::string MLExpression::ToString() const{
+    std::ostringstream out;
+    Write(out);
+    return out.str();
+}
+
+void MLExpression::Write(std::ostream &out) const{
+    char buffer[32];
+
+    switch(kind){
+        case Integer:
+            out << integer;
+            break;
+
+        case BigInteger:
+            out << text;
+            break;
+
+        case Real:
+        {
+            //Enough digits to read back the same double, with Mathematica's *^ for the exponent. A trailing "." keeps a whole number a Real.
+            std::snprintf(buffer, sizeof buffer, "%.17g", real);
+            char *exponent = std::strchr(buffer, 'e');
+            if(exponent) *exponent = '\0';
+            out << buffer;
+            if(std::strpbrk(buffer, ".ni") == nullptr) out << '.';
+            if(exponent) out << "*^" << std::atoi(exponent + 1);
+            break;
+        }
+
+        case String:
+            out << '"';
+            for(char c : text){
+                switch(c){
+                    case '"': out << "\\\""; break;
+                    case '\\': out << "\\\\"; break;
+                    case '\n': out << "\\n"; break;
+                    case '\t': out << "\\t"; break;
+                    default: out << c;
+                }
+            }
+            out << '"';
+            break;
+
+        case Symbol:
+            out << text;
+            break;
+
+        case Normal: {
+            bool list = HasHead("List");
+            if(list){
+                out << '{';
+            } else{
+                Head().Write(out);
+                out << '[';
+            }
+            for(size_t i = 1; i < parts.size(); i++){
+                if(i > 1) out << ", ";
+                parts[i].Write(out);
+            }
+            out << (list ? '}' : ']');
+            break;
+        }
+    }
+}
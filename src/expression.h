@@ -0,0 +1,51 @@
+//
+//  expression.h
+//  MathLinkBridge
+//
+//  A Mathematica expression as read off the link with the native get calls,
+//  so that a result can be used as data without the kernel formatting it as
+//  text and us parsing it back. Atoms hold their value directly. A normal
+//  expression holds its head and then its arguments in parts, so f[x, y] is
+//  {f, x, y}. The kernel's integers are arbitrary precision; one that
+//  doesn't fit in 64 bits is a BigInteger, which keeps its digits as text.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+struct MLExpression{
+    enum Kind {Integer, Real, String, Symbol, Normal, BigInteger};
+
+    Kind kind = Symbol;
+    union {
+        long long integer;
+        double real;
+    };
+    //The characters of a String, the name of a Symbol or the decimal digits of a BigInteger, in UTF-8.
+    std::string text;
+    //For a Normal expression: the head, then the arguments.
+    std::vector<MLExpression> parts;
+
+    MLExpression(): integer(0) {}
+
+    static MLExpression MakeInteger(long long value);
+    static MLExpression MakeReal(double value);
+    static MLExpression MakeString(std::string value);
+    static MLExpression MakeSymbol(std::string name);
+
+    bool IsAtom() const { return kind != Normal; }
+    //Whether this is a normal expression whose head is the symbol name.
+    bool HasHead(const char *name) const;
+    const MLExpression &Head() const { return parts.front(); }
+    //The number of arguments of a Normal expression, 0 for an atom.
+    size_t Length() const { return parts.empty() ? 0 : parts.size() - 1; }
+    //The i-th argument, counting from 1 as Mathematica does.
+    const MLExpression &Argument(size_t i) const { return parts[i]; }
+
+    //The expression in InputForm, more or less. Lists are written with braces.
+    std::string ToString() const;
+    void Write(std::ostream &out) const;
+};
@@ -0,0 +1,44 @@
+//
+//  imagesink.cpp
+//  MathLinkBridge
+//
+
+#include <iostream>
+#include <utility>
+
+#include <unistd.h>
+
+#include "imagesink.h"
+
+FileImageSink::FileImageSink(std::string newDirectory, std::string newPrefix):
+    directory(std::move(newDirectory)),
+    prefix(std::move(newPrefix)){
+    if(!directory.empty() && directory.back() != '/') directory.push_back('/');
+    //Several MathLines may share a directory.
+    prefix += std::to_string(getpid()) + "-";
+}
+
+void FileImageSink::Begin(){
+    path = directory + prefix + std::to_string(++count) + ".ps";
+    file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if(!file){
+        //We can't stop the kernel from sending the rest of the image, so the best we can do is say so and drop it.
+        std::cerr << "Could not open " << path << " to write an image to." << std::endl;
+    }
+}
+
+void FileImageSink::Append(std::string_view chunk){
+    if(file.is_open()) file.write(chunk.data(), (std::streamsize)chunk.size());
+}
+
+std::string FileImageSink::End(){
+    if(!file.is_open()) return "";
+
+    file.close();
+    if(!file){
+        std::cerr << "Could not write the image to " << path << "." << std::endl;
+        unlink(path.c_str());
+        return "";
+    }
+    return path;
+}
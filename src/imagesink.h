@@ -0,0 +1,46 @@
+//
+//  imagesink.h
+//  MathLinkBridge
+//
+//  Where the images (PostScript code) the kernel sends end up. By default
+//  MLBridge collects each image in memory and queues the PostScript itself
+//  in MLBridge::images. An IImageSink receives the image a chunk at a time
+//  as it arrives instead, and gives MLBridge a handle to queue in its place,
+//  so that large graphics never have to be held in memory whole.
+//
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <fstream>
+
+class IImageSink {
+public:
+    virtual ~IImageSink() = default;
+
+    //The kernel is starting to send a new image.
+    virtual void Begin() = 0;
+    //The next piece of the image, in order.
+    virtual void Append(std::string_view chunk) = 0;
+    //The image is complete. Returns the handle MLBridge queues in images, or the empty string if the image was lost.
+    virtual std::string End() = 0;
+};
+
+//Writes each image to its own file as it arrives. The handle is the path of the file. The files belong to the caller once queued.
+class FileImageSink: public IImageSink {
+public:
+    //Files are named prefix + number + ".ps" in directory, which must exist.
+    explicit FileImageSink(std::string directory, std::string prefix = "mathline-");
+
+    void Begin() override;
+    void Append(std::string_view chunk) override;
+    std::string End() override;
+
+private:
+    std::string directory;
+    std::string prefix;
+    std::string path;
+    std::ofstream file;
+    int count = 0;
+};
@@ -0,0 +1,64 @@
+//
+//  jsonrecord.cpp
+//  MathLinkBridge
+//
+
+#include "jsonrecord.h"
+
+JSONRecord::JSONRecord(std::ostream &newOut, const char *type): out(newOut){
+    out << "{\"type\":\"" << type << '"';
+}
+
+JSONRecord::~JSONRecord(){
+    out << "}\n";
+}
+
+JSONRecord &JSONRecord::AddString(const char *name, std::string_view value){
+    BeginString(name);
+    WriteEscaped(out, value);
+    return EndString();
+}
+
+JSONRecord &JSONRecord::AddInteger(const char *name, long long value){
+    out << ",\"" << name << "\":" << value;
+    return *this;
+}
+
+JSONRecord &JSONRecord::AddBoolean(const char *name, bool value){
+    out << ",\"" << name << "\":" << (value ? "true" : "false");
+    return *this;
+}
+
+JSONRecord &JSONRecord::BeginString(const char *name){
+    out << ",\"" << name << "\":\"";
+    return *this;
+}
+
+JSONRecord &JSONRecord::EndString(){
+    out << '"';
+    return *this;
+}
+
+void JSONRecord::WriteEscaped(std::ostream &out, std::string_view text){
+    static const char hex[] = "0123456789abcdef";
+    size_t start = 0;
+
+    //Write the text in runs between the characters that need escaping, rather than a character at a time.
+    for(size_t i = 0; i < text.size(); i++){
+        unsigned char c = (unsigned char)text[i];
+        if(c >= 0x20 && c != '"' && c != '\\') continue;
+
+        out.write(text.data() + start, (std::streamsize)(i - start));
+        start = i + 1;
+        switch(c){
+            case '"': out << "\\\""; break;
+            case '\\': out << "\\\\"; break;
+            case '\n': out << "\\n"; break;
+            case '\r': out << "\\r"; break;
+            case '\t': out << "\\t"; break;
+            default:
+                out << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+        }
+    }
+    out.write(text.data() + start, (std::streamsize)(text.size() - start));
+}
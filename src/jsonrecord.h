@@ -0,0 +1,37 @@
+//
+//  jsonrecord.h
+//  MathLinkBridge
+//
+//  Writes the records of MathLine's JSON Lines protocol (--protocol jsonl):
+//  one JSON object per line, each with a "type" field saying what it is. A
+//  record is written field by field as it is built and closed when the
+//  JSONRecord goes out of scope, so even a huge result never has to be held
+//  in memory to be framed.
+//
+
+#pragma once
+
+#include <ostream>
+#include <string_view>
+
+class JSONRecord{
+public:
+    JSONRecord(std::ostream &out, const char *type);
+    ~JSONRecord();
+    JSONRecord(const JSONRecord &) = delete;
+    JSONRecord &operator=(const JSONRecord &) = delete;
+
+    JSONRecord &AddString(const char *name, std::string_view value);
+    JSONRecord &AddInteger(const char *name, long long value);
+    JSONRecord &AddBoolean(const char *name, bool value);
+
+    //For a string too large to have in hand all at once: BeginString(), then write the value to the stream a piece at a time with WriteEscaped(), then EndString().
+    JSONRecord &BeginString(const char *name);
+    JSONRecord &EndString();
+
+    //Writes text with everything JSON requires escaped. UTF-8 passes through as is.
+    static void WriteEscaped(std::ostream &out, std::string_view text);
+
+private:
+    std::ostream &out;
+};
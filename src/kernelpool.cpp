@@ -0,0 +1,185 @@
+//
+//  kernelpool.cpp
+//  MathLinkBridge
+//
+
+#include <sstream>
+#include <utility>
+
+#include "kernelpool.h"
+#include "jsonrecord.h"
+#include "scanner.h"
+
+KernelPool::KernelPool(int size, int argc, const char *argv[], LinkFactory factory){
+    for(int i = 0; i < size; i++){
+        MLBridge *bridge = factory ? new MLBridge(factory()) : new MLBridge(argc, argv);
+        bridge->argc = argc;
+        bridge->argv = argv;
+        bridges.emplace_back(bridge);
+    }
+}
+
+KernelPool::~KernelPool(){
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        jobs.clear();
+    }
+    jobsChanged.notify_all();
+    for(auto &worker : workers) worker.join();
+}
+
+void KernelPool::Connect(){
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        starting = (int)bridges.size();
+    }
+
+    for(auto &bridge : bridges){
+        //Each kernel keeps its own session history, so numbering In[#]/Out[#] would only confuse.
+        bridge->useMainLoop = false;
+        //Only the main thread gets to handle ctrl+c.
+        bridge->handleInterrupts = false;
+        bridge->blockingWait = blockingWait;
+        bridge->streamBufferSize = streamBufferSize;
+        bridge->connectTimeout = connectTimeout;
+        bridge->protocol = protocol;
+        bridge->packetStatistics = packetStatistics;
+        workers.emplace_back(&KernelPool::Work, this, std::ref(*bridge));
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    resultsChanged.wait(lock, [this]{ return starting == 0; });
+    if(alive == 0){
+        throw MLBridgeException("None of the " + std::to_string(bridges.size()) + " kernels in the pool could be started.");
+    }
+}
+
+int KernelPool::Alive(){
+    std::lock_guard<std::mutex> lock(mutex);
+    return alive;
+}
+
+void KernelPool::Work(MLBridge &bridge){
+    //Launching a kernel takes a while, so every worker launches its own at the same time as the others.
+    try {
+        bridge.Connect();
+    } catch (MLBridgeException &) {
+        std::lock_guard<std::mutex> lock(mutex);
+        starting--;
+        resultsChanged.notify_all();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        starting--;
+        alive++;
+    }
+    resultsChanged.notify_all();
+
+    while(true){
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobsChanged.wait(lock, [this]{ return stopping || !jobs.empty(); });
+            if(stopping) return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        std::ostringstream out;
+        try {
+            bridge.EvaluateTo(job.input, out);
+        } catch (MLBridgeException &e) {
+            //The bridge disconnects on link errors, so this kernel is done.
+            std::unique_lock<std::mutex> lock(mutex);
+            alive--;
+            if(!job.retried && alive > 0){
+                //Give the input one more chance on a kernel that is still up, ahead of everything that came after it.
+                job.retried = true;
+                jobs.push_front(std::move(job));
+                lock.unlock();
+                jobsChanged.notify_one();
+            } else{
+                if(protocol == MLBridge::JSONLinesProtocol){
+                    JSONRecord(out, "error").AddString("text", e.ToString()).AddInteger("code", e.errorCode);
+                } else{
+                    out << e.ToString() << "\n";
+                }
+                results[job.ticket] = out.str();
+                lock.unlock();
+            }
+            resultsChanged.notify_all();
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            results[job.ticket] = out.str();
+        }
+        resultsChanged.notify_all();
+    }
+}
+
+size_t KernelPool::Submit(std::string input){
+    size_t ticket;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ticket = nextTicket++;
+        jobs.push_back(Job{ticket, std::move(input)});
+    }
+    jobsChanged.notify_one();
+    return ticket;
+}
+
+std::string KernelPool::Result(size_t ticket){
+    std::unique_lock<std::mutex> lock(mutex);
+    resultsChanged.wait(lock, [this, ticket]{ return results.count(ticket) > 0 || alive == 0; });
+
+    auto found = results.find(ticket);
+    if(found == results.end()){
+        throw MLBridgeException("Every kernel in the pool has died.");
+    }
+    std::string output = std::move(found->second);
+    results.erase(found);
+    return output;
+}
+
+void KernelPool::Batch(std::istream &in, std::ostream &out){
+    std::string expression;
+    //The inputs we have submitted but not yet printed the output of, oldest first.
+    std::deque<std::pair<size_t, std::string>> outstanding;
+    //Keep every kernel busy, with a little slack so that a kernel finishing early has something to pick up.
+    size_t window = 2 * bridges.size();
+    bool endOfInput = false;
+
+    try {
+        while(true){
+            while(!endOfInput && outstanding.size() < window){
+                if(!ReadExpression(in, expression) || expression == "Exit" || expression == "Exit[]" || expression == "Quit"){
+                    endOfInput = true;
+                    break;
+                }
+                size_t ticket = Submit(expression);
+                outstanding.emplace_back(ticket, std::move(expression));
+            }
+            if(outstanding.empty()) break;
+
+            //Print in submission order no matter which kernel finishes first.
+            std::string inString = showInOutStrings ? "In[" + std::to_string(outstanding.front().first + 1) + "]:= " : "";
+            if(protocol == MLBridge::JSONLinesProtocol){
+                JSONRecord(out, "input").AddString("prompt", inString).AddString("text", outstanding.front().second);
+            } else{
+                out << "\n\n" << prompt << inString << outstanding.front().second << "\n";
+            }
+            out << Result(outstanding.front().first);
+            outstanding.pop_front();
+        }
+    } catch (MLBridgeException &e) {
+        if(protocol == MLBridge::JSONLinesProtocol){
+            JSONRecord(out, "error").AddString("text", e.ToString()).AddInteger("code", e.errorCode);
+        } else{
+            out << e.ToString() << std::endl;
+        }
+    }
+}
@@ -0,0 +1,92 @@
+//
+//  kernelpool.h
+//  MathLinkBridge
+//
+//  Runs several kernels side by side. Each kernel has its own MLBridge and
+//  link, and is driven by its own worker thread that takes inputs from a
+//  shared queue whenever its kernel is idle. Inputs must be independent of
+//  each other, since consecutive inputs may land on different kernels.
+//
+//  If a kernel dies partway through an input, that input is put back at the
+//  front of the queue for another live kernel, once. The output of the
+//  failed attempt is discarded. An input whose second attempt also kills
+//  its kernel, or that has no kernel left to go to, gets the error appended
+//  to its output instead.
+//
+//  The kernels bypass the Main Loop, so there are no In[#]/Out[#] variables.
+//  Every input is identified by the ticket Submit() returns instead; tickets
+//  count up from zero in submission order.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <istream>
+#include <ostream>
+
+#include "mlbridge.h"
+
+class KernelPool{
+public:
+    //Supplies the link for each kernel, e.g. a MockLink. By default each MLBridge opens its own WSTPLink.
+    typedef std::function<std::unique_ptr<ILink>()> LinkFactory;
+
+    //Each kernel is launched with the given MMAOpenArgcArgv style arguments, which must outlive the pool.
+    KernelPool(int size, int argc, const char *argv[], LinkFactory factory = nullptr);
+    ~KernelPool();
+
+    //Passed on to each kernel's MLBridge. Set these before calling Connect().
+    bool blockingWait = true;
+    int streamBufferSize = 0;
+    int connectTimeout = 0;
+    //Shared by every kernel. PacketStatistics only uses atomics, so the kernels can record into it at the same time.
+    PacketStatistics *packetStatistics = nullptr;
+    //How each kernel writes its output, and Batch() the inputs and errors around it.
+    MLBridge::Protocol protocol = MLBridge::TextProtocol;
+    //Used by Batch() to label its output.
+    std::string prompt{""};
+    bool showInOutStrings = true;
+
+    //Launches all of the kernels at once and waits until they are up. Throws MLBridgeException if none of them start.
+    void Connect();
+    //The number of kernels that are up and haven't died.
+    int Alive();
+
+    //Queues input for the next idle kernel and returns its ticket.
+    size_t Submit(std::string input);
+    //Waits for the output of the given ticket and hands it over. Each ticket's output can only be collected once.
+    std::string Result(size_t ticket);
+    //Evaluates every complete expression read from in and writes the outputs to out in submission order.
+    void Batch(std::istream &in, std::ostream &out);
+
+private:
+    struct Job{
+        size_t ticket;
+        std::string input;
+        //Set once the job has been requeued after its kernel died.
+        bool retried = false;
+    };
+
+    std::vector<std::unique_ptr<MLBridge>> bridges;
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable jobsChanged;
+    std::condition_variable resultsChanged;
+    std::deque<Job> jobs;
+    std::unordered_map<size_t, std::string> results;
+    size_t nextTicket = 0;
+    int starting = 0;
+    int alive = 0;
+    bool stopping = false;
+
+    void Work(MLBridge &bridge);
+};
@@ -0,0 +1,74 @@
+//
+//  link.h
+//  MathLinkBridge
+//
+//  The interface MLBridge uses to talk to a kernel. WSTPLink forwards each
+//  call to the MathLink/WSTP library. MockLink replays a recorded kernel
+//  session so that MLBridge can be exercised without Mathematica.
+//
+//  The methods deliberately mirror the MMA- functions they replace: they
+//  return nonzero on success and report failure through Error() and
+//  ErrorMessage(), just like the C library does.
+//
+
+#pragma once
+
+#include <string>
+#include <functional>
+
+#include "config.h"
+
+class ILink {
+public:
+    //Result of waiting for the kernel.
+    enum WaitResult {WaitSuccess, WaitError, WaitAborted};
+    //Polled while waiting for link activity. Returning true aborts the wait.
+    typedef std::function<bool()> AbortCallback;
+
+    virtual ~ILink() = default;
+
+    //Opens the link with MMAOpenArgcArgv style arguments. Returns MMAEOK or an error code.
+    virtual int Open(int argc, const char *argv[]) = 0;
+    virtual int Activate() = 0;
+    //Closes the link. Safe to call more than once.
+    virtual void Close() = 0;
+
+    //Blocks until there is something to read. If abort is given, it is polled while we wait.
+    virtual WaitResult WaitForLinkActivity(AbortCallback abort = nullptr) = 0;
+    virtual int Ready() = 0;
+    virtual int NextPacket() = 0;
+    virtual int NewPacket() = 0;
+    //The returned buffer is owned by the link and is valid until ReleaseUTF8String is called. It is NOT null terminated.
+    virtual int GetUTF8String(const unsigned char **string, int *bytes, int *characters) = 0;
+    virtual int GetUTF8Symbol(const unsigned char **string, int *bytes, int *characters) = 0;
+    virtual void ReleaseUTF8String(const unsigned char *string, int bytes) = 0;
+    //Reads the next string in pieces of at most capacity bytes. remaining receives the number of bytes still to be read; keep calling until it is zero.
+    virtual int GetUTF8Characters(int *remaining, unsigned char *buffer, int capacity, int *bytes, int *characters) = 0;
+    virtual int GetInteger(int *integer) = 0;
+    //Returns the type of the next token of an expression, one of the MMATK constants, without reading it. A function (MMATKFUNC) is read with GetArgCount, after which its head and then its arguments follow as expressions of their own.
+    virtual int GetNext() = 0;
+    virtual int GetArgCount(int *count) = 0;
+    virtual int GetInteger64(long long *integer) = 0;
+    virtual int GetReal64(double *real) = 0;
+    /*
+     Reads a rectangular array of numbers, packed or not, all at once. The data is stored in row major order and, like the dimensions and heads (one per level, usually "List"), belongs to the link until ReleaseArray is called.
+     */
+    virtual int GetArray(double **data, int **dimensions, char ***heads, int *depth) = 0;
+    virtual int GetArray(long long **data, int **dimensions, char ***heads, int *depth) = 0;
+    virtual void ReleaseArray(double *data, int *dimensions, char **heads, int depth) = 0;
+    virtual void ReleaseArray(long long *data, int *dimensions, char **heads, int depth) = 0;
+
+    virtual int PutFunction(const char *head, int argCount) = 0;
+    virtual int PutUTF8String(const unsigned char *string, int bytes) = 0;
+    virtual int PutSymbol(const char *symbol) = 0;
+    //Sends data, stored in row major order, as a packed array of nested lists with the given dimensions. The data is read straight from the caller's memory.
+    virtual int PutArray(const double *data, const int *dimensions, int depth) = 0;
+    virtual int PutArray(const long long *data, const int *dimensions, int depth) = 0;
+    virtual int EndPacket() = 0;
+    virtual int Flush() = 0;
+    //Asks the kernel to interrupt the current computation.
+    virtual int PutInterruptMessage() = 0;
+
+    virtual int Error() = 0;
+    virtual std::string ErrorMessage() = 0;
+};
@@ -8,8 +8,19 @@
 //
 
 #include <iostream>
+#include <fstream>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
 #include "popl.hpp"
 #include "mlbridge.h"
+#include "kernelpool.h"
+#include "daemon.h"
+#include "jsonrecord.h"
+#include "mappedfile.h"
+#include "resultcache.h"
+#include "packetstats.h"
+#include "tracer.h"
 
 #define CONTINUE 0
 #define QUIT_WITH_SUCCESS 1
@@ -24,6 +35,20 @@ char *copyDataFromString(const std::string &str){
 }
 
 bool check_and_exit = false;
+std::string batch_file;
+std::string script_file;
+int kernel_count = 1;
+bool report_timings = false;
+std::string image_directory;
+std::string daemon_socket;
+std::string client_socket;
+std::string result_cache;
+bool clear_result_cache = false;
+std::string packet_stats_file;
+PacketStatistics packet_statistics;
+int packet_stats_fd = -1;
+std::string trace_file;
+std::unique_ptr<EvaluationTracer> evaluation_tracer;
 
 int ParseProgramOptions(MLBridge &bridge, int argc, const char * argv[]){
 
@@ -36,6 +61,25 @@ int ParseProgramOptions(MLBridge &bridge, int argc, const char * argv[]){
     popl::Value<std::string> linknameOption("n", "linkname", "String. The call string to set up the link.\nDefaults to \"math -" MMANAME_LOWER "\".", "math -" MMANAME_LOWER);
     popl::Value<std::string> linkmodeOption("l", "linkmode", "String. The " MMANAME " link mode. The default\nlaunches a new kernel which is almost\ncertainly what you want. It should be\npossible, however, to connect to a pre\nexisting kernel. Defaults to \"linklaunch\".", "linklaunch");
     popl::Value<bool> getlineOption("g", "usegetline", "Boolean. If set to false, we use readline-\nlike input with command history and emacs-\nstyle editing capability. If set to true, we\nuse a simplified getline input with limited\nediting capability. Defaults to false.", false, &bridge.useGetline);
+    popl::Value<bool> scaninputOption("e", "scaninput", "Boolean. If set to true, MathLine reads lines\nuntil they form a complete expression before\nsending anything to the kernel. If set to\nfalse, each line is sent as it is read and\nthe kernel asks for more. Defaults to true.", true, &bridge.scanInput);
+    popl::Value<bool> blockingwaitOption("w", "blockingwait", "Boolean. If set to true, MathLine sleeps while\nthe kernel computes. If set to false, MathLine\npolls the link continuously, which uses a\nfull core. Defaults to true.", true, &bridge.blockingWait);
+    popl::Value<int> streambufferOption("s", "streambuffer", "Integer (nonnegative). If positive, results are\nwritten out in pieces of at most this many\nbytes as they are read from the kernel,\ninstead of being read into memory whole.\nDefaults to 0.", 0, &bridge.streamBufferSize);
+    popl::Value<std::string> batchOption("b", "batch", "String. Evaluate the expressions in this file\n(or standard input if \"-\") and exit\ninstead of starting an interactive session.", "", &batch_file);
+    popl::Value<std::string> fileOption("f", "file", "String. Like batch, but the file is memory mapped\nand each expression is sent to the kernel\nstraight from the mapping, which suits very\nlarge scripts. The file must be a regular\nfile.", "", &script_file);
+    popl::Value<int> pipelineOption("d", "pipeline", "Integer (positive). In batch mode, the number\nof inputs sent to the kernel before waiting\nfor the first result. Defaults to 16.", 16, &bridge.pipelineDepth);
+    popl::Value<int> kernelsOption("k", "kernels", "Integer (positive). In batch mode, the number\nof kernels to evaluate inputs on in parallel.\nInputs must not depend on each other. With\nmore than one kernel the Main Loop is not\nused. Defaults to 1.", 1, &kernel_count);
+    popl::Value<int> outputbufferOption("o", "outputbuffer", "Integer (nonnegative). The number of bytes of\noutput to collect before writing it out. All\noutput is written out before waiting on the\nkernel or for input regardless. 0 writes\nevery line out at once. Defaults to 65536.", 64 * 1024, &bridge.outputBufferSize);
+    popl::Value<std::string> protocolOption("P", "protocol", "String. \"text\" for people, or \"jsonl\" to write\neach prompt, result, message and so on as\na JSON object on a line of its own, for\nprograms driving MathLine. Defaults to\n\"text\".", "text");
+    popl::Value<int> timeoutOption("t", "timeout", "Integer (nonnegative). If positive, give up on\nthe kernel if it isn't up after this many\nmilliseconds. Defaults to 0, which waits\nas long as it takes.", 0, &bridge.connectTimeout);
+    popl::Switch timingsOption("T", "timings", "Report how long each phase of connecting to\nthe kernel took.");
+    popl::Switch standbyOption("S", "standby", "Keep a second kernel running in the background\nand switch to it at once if the kernel dies.");
+    popl::Value<std::string> imagedirOption("I", "imagedir", "String. Write each image the kernel sends to\nits own file in this directory as it arrives,\ninstead of keeping it in memory.", "", &image_directory);
+    popl::Value<std::string> daemonOption("D", "daemon", "String. Keep the kernel running and serve it to\nclients connecting to the Unix domain socket\nat this path, instead of starting an\ninteractive session. A client sending Exit or\nQuit stops the daemon.", "", &daemon_socket);
+    popl::Value<std::string> clientOption("C", "client", "String. Send standard input to the daemon\nlistening on the socket at this path and print\nits output, instead of launching a kernel.", "", &client_socket);
+    popl::Value<std::string> resultcacheOption("r", "resultcache", "String. Cache the results of evaluations and\nserve repeated inputs from the cache. Either\n\"memory\", or a directory to keep the cache in\nacross runs. Only for pure inputs, in batch\nmode without the Main Loop.", "", &result_cache);
+    popl::Switch clearcacheOption("R", "clearcache", "Empty the result cache before starting.");
+    popl::Value<std::string> packetstatsOption("u", "packetstats", "String. Count and time every packet received\nfrom the kernel, by packet type, and write\nthe statistics to this file (or standard\nerror if \"-\") on exit and whenever MathLine\nreceives SIGUSR1.", "", &packet_stats_file);
+    popl::Value<std::string> traceOption("y", "trace", "String. Record a timeline of every evaluation\n(reading input, sending it, waiting for and\nhandling each packet) and write it to this\nfile on exit, in the Chrome trace event format\nthat chrome://tracing and Perfetto open.", "", &trace_file);
     popl::Value<int> maxhistoryOption("x", "maxhistory", "Integer (nonnegative). The maximum number of\nlines to keep in the input history.Defaults\nto 10.", 10);
 
     popl::OptionParser op("MathLine Usage");
@@ -47,6 +91,25 @@ int ParseProgramOptions(MLBridge &bridge, int argc, const char * argv[]){
             .add(linknameOption)
             .add(linkmodeOption)
             .add(getlineOption)
+            .add(scaninputOption)
+            .add(blockingwaitOption)
+            .add(streambufferOption)
+            .add(batchOption)
+            .add(fileOption)
+            .add(pipelineOption)
+            .add(kernelsOption)
+            .add(outputbufferOption)
+            .add(protocolOption)
+            .add(timeoutOption)
+            .add(timingsOption)
+            .add(standbyOption)
+            .add(imagedirOption)
+            .add(daemonOption)
+            .add(clientOption)
+            .add(resultcacheOption)
+            .add(clearcacheOption)
+            .add(packetstatsOption)
+            .add(traceOption)
             .add(maxhistoryOption);
 
     // Parse the options.
@@ -96,6 +159,64 @@ int ParseProgramOptions(MLBridge &bridge, int argc, const char * argv[]){
             bridge.argv[1] = copyDataFromString("-" + str);
         }
     }
+    if(standbyOption.isSet()){
+        bridge.keepStandby = true;
+    }
+    if(!image_directory.empty()){
+        bridge.SetImageSink(std::unique_ptr<IImageSink>(new FileImageSink(image_directory)));
+    }
+    if(protocolOption.getValue() == "jsonl"){
+        bridge.protocol = MLBridge::JSONLinesProtocol;
+    } else if(protocolOption.getValue() != "text"){
+        std::cout << "Option protocol must be text or jsonl. Ignoring." << std::endl;
+    }
+    if(!result_cache.empty()){
+        auto cache = std::unique_ptr<ResultCache>(new ResultCache(result_cache == "memory" ? "" : result_cache));
+        if(clearcacheOption.isSet()) cache->Clear();
+        bridge.SetResultCache(std::move(cache));
+    } else if(clearcacheOption.isSet()){
+        std::cout << "Option clearcache needs resultcache. Ignoring." << std::endl;
+    }
+    if(!packet_stats_file.empty()){
+        packet_stats_fd = packet_stats_file == "-" ? STDERR_FILENO : open(packet_stats_file.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if(packet_stats_fd < 0){
+            std::cout << "Could not open " << packet_stats_file << " for option packetstats. Ignoring." << std::endl;
+        } else{
+            bridge.packetStatistics = &packet_statistics;
+            PacketStatistics::DumpOnSignal(&packet_statistics, packet_stats_fd, SIGUSR1);
+        }
+    }
+    if(!trace_file.empty()){
+        evaluation_tracer.reset(new EvaluationTracer());
+        bridge.tracer = evaluation_tracer.get();
+    }
+    if(timingsOption.isSet()){
+        report_timings = true;
+    }
+    if(bridge.connectTimeout < 0){
+        std::cout << "Option timeout must be nonnegative. Ignoring." << std::endl;
+        bridge.connectTimeout = 0;
+    }
+    if(bridge.streamBufferSize < 0){
+        std::cout << "Option streambuffer must be nonnegative. Ignoring." << std::endl;
+        bridge.streamBufferSize = 0;
+    }
+    if(bridge.outputBufferSize < 0){
+        std::cout << "Option outputbuffer must be nonnegative. Ignoring." << std::endl;
+        bridge.outputBufferSize = 64 * 1024;
+    }
+    if(bridge.pipelineDepth < 1){
+        std::cout << "Option pipeline must be positive. Ignoring." << std::endl;
+        bridge.pipelineDepth = 16;
+    }
+    if(kernel_count < 1){
+        std::cout << "Option kernels must be positive. Ignoring." << std::endl;
+        kernel_count = 1;
+    }
+    if(!batch_file.empty() && !script_file.empty()){
+        std::cout << "Options batch and file cannot be used together. Ignoring file." << std::endl;
+        script_file.clear();
+    }
     if(maxhistoryOption.isSet()){
         int max = maxhistoryOption.getValue();
         if (max >= 0) {
@@ -108,10 +229,48 @@ int ParseProgramOptions(MLBridge &bridge, int argc, const char * argv[]){
     return CONTINUE;
 }
 
-int main(int argc, const char * argv[]) {
-    //Banner
-    std::cout << "MathLine v" MATHLINE_VERSION ": A free and open source textual interface to Mathematica." << std::endl;
+/// Evaluate the batch input on a pool of kernels instead of the single kernel `bridge` would connect to.
+int RunKernelPool(MLBridge &bridge){
+    std::ifstream file;
+    std::istream *in = &std::cin;
+
+    if(batch_file != "-"){
+        file.open(batch_file);
+        if(!file){
+            std::cerr << "Could not open " << batch_file << "." << std::endl;
+            return 1;
+        }
+        in = &file;
+    }
 
+    KernelPool pool(kernel_count, bridge.argc, bridge.argv);
+    pool.blockingWait = bridge.blockingWait;
+    pool.streamBufferSize = bridge.streamBufferSize;
+    pool.connectTimeout = bridge.connectTimeout;
+    pool.protocol = bridge.protocol;
+    pool.packetStatistics = bridge.packetStatistics;
+    //The pool's kernels evaluate one input at a time with EvaluateTo(), which neither traces nor caches.
+    if(bridge.tracer) std::cerr << "Option trace does not apply with kernels. Ignoring." << std::endl;
+    if(bridge.GetResultCache()) std::cerr << "Option resultcache does not apply with kernels. Ignoring." << std::endl;
+    pool.prompt = bridge.prompt;
+    pool.showInOutStrings = bridge.showInOutStrings;
+    try{
+        pool.Connect();
+    } catch(MLBridgeException &e){
+        std::cerr << e.ToString() << "\n";
+        std::cerr << "Could not connect to Mathematica. Check that " << bridge.argv[3] << " works from a command line." << std::endl;
+        return 1;
+    }
+    if(pool.Alive() < kernel_count){
+        std::cerr << "Only " << pool.Alive() << " of " << kernel_count << " kernels started." << std::endl;
+    }
+
+    pool.Batch(*in, std::cout);
+    if(bridge.packetStatistics) packet_statistics.WriteTo(packet_stats_fd);
+    return 0;
+}
+
+int main(int argc, const char * argv[]) {
     MLBridge bridge;
     
     //Parse the command line arguments.
@@ -120,6 +279,31 @@ int main(int argc, const char * argv[]) {
         // An unknown argument was supplied, so we exit.
         return parseFailed;
     }
+
+    //A client's output is the daemon's output and nothing else, so it goes before the banner.
+    if(!client_socket.empty()){
+        if(!RunDaemonClient(client_socket, std::cin, std::cout)){
+            std::cerr << "Could not connect to a MathLine daemon at " << client_socket << "." << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    //Banner
+    if(bridge.protocol == MLBridge::JSONLinesProtocol){
+        JSONRecord(std::cout, "banner").AddString("version", MATHLINE_VERSION);
+    } else{
+        std::cout << "MathLine v" MATHLINE_VERSION ": A free and open source textual interface to Mathematica." << std::endl;
+    }
+
+    //A pool reads its input as a stream.
+    if(kernel_count > 1 && !script_file.empty()){
+        batch_file = script_file;
+        script_file.clear();
+    }
+    if(kernel_count > 1 && !batch_file.empty()){
+        return RunKernelPool(bridge);
+    }
     
     //Attempt to establish the MathLink connection using the options we've set.
     try{
@@ -130,16 +314,61 @@ int main(int argc, const char * argv[]) {
         return 1;
     }
     if(bridge.IsConnected()){
+        if(report_timings){
+            //Standard error, so as not to get mixed up with the session.
+            const MLBridgeConnectTimings &timings = bridge.GetConnectTimings();
+            std::cerr << "Connected in " << timings.Total() << " ms (open " << timings.open
+                      << " ms, activate " << timings.activate << " ms, first prompt " << timings.firstPrompt
+                      << " ms, $PrePrint " << timings.prePrint << " ms)." << std::endl;
+        }
         //Let's print the kernel version.
-        std::cout << "Mathematica " << bridge.GetKernelVersion() << "\n" << std::endl;
+        if(bridge.protocol == MLBridge::JSONLinesProtocol){
+            JSONRecord(std::cout, "kernel").AddString("version", bridge.GetKernelVersion());
+        } else{
+            std::cout << "Mathematica " << bridge.GetKernelVersion() << "\n" << std::endl;
+        }
         if( check_and_exit ){
             //Don't enter the REPL, just check and exit.
             std::string test = "1+2";
             std::cout << bridge.kernelPrompt << test << "\n";
             std::cout << bridge.GetEvaluated("1+2") << std::endl;
+        }else if(!daemon_socket.empty()){
+            try{
+                ServeDaemon(bridge, daemon_socket);
+            } catch(MLBridgeException &e){
+                std::cerr << e.ToString() << std::endl;
+                return 1;
+            }
+        }else if(!script_file.empty()){
+            MappedFile script;
+            if(!script.Open(script_file)){
+                std::cerr << "Could not open " << script_file << ": " << script.Error() << std::endl;
+                return 1;
+            }
+            bridge.Batch(script.View());
+        }else if(batch_file == "-"){
+            bridge.Batch(std::cin);
+        }else if(!batch_file.empty()){
+            std::ifstream in(batch_file);
+            if(!in){
+                std::cerr << "Could not open " << batch_file << "." << std::endl;
+                return 1;
+            }
+            bridge.Batch(in);
         }else{
             bridge.REPL();
         }
+        if(bridge.packetStatistics) packet_statistics.WriteTo(packet_stats_fd);
+        if(bridge.tracer){
+            std::ofstream trace(trace_file);
+            bridge.tracer->WriteJSON(trace);
+            if(!trace) std::cerr << "Could not write the trace to " << trace_file << "." << std::endl;
+        }
+        if(ResultCache *cache = bridge.GetResultCache()){
+            const ResultCache::Counters &counters = cache->GetCounters();
+            std::cerr << "Result cache: " << counters.hits << " hits, " << counters.misses << " misses, "
+                      << counters.stores << " stored." << std::endl;
+        }
 
     } else{
         std::cout << "MLBridge failed to connect.";
@@ -0,0 +1,63 @@
+//
+//  mappedfile.cpp
+//  MathLinkBridge
+//
+
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mappedfile.h"
+
+MappedFile::~MappedFile(){
+    Close();
+}
+
+bool MappedFile::Open(const std::string &path){
+    struct stat status;
+
+    Close();
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0){
+        error = std::strerror(errno);
+        return false;
+    }
+    if(fstat(fd, &status) != 0){
+        error = std::strerror(errno);
+        close(fd);
+        return false;
+    }
+    if(!S_ISREG(status.st_mode)){
+        error = "Not a regular file.";
+        close(fd);
+        return false;
+    }
+
+    //An empty file is fine, but mmap won't map zero bytes.
+    if(status.st_size > 0){
+        void *mapping = mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mapping == MAP_FAILED){
+            error = std::strerror(errno);
+            close(fd);
+            return false;
+        }
+        //We read the script front to back, once.
+        madvise(mapping, (size_t)status.st_size, MADV_SEQUENTIAL);
+        data = (const char *)mapping;
+        size = (size_t)status.st_size;
+    }
+    //The mapping keeps the file open for us.
+    close(fd);
+    error.clear();
+    return true;
+}
+
+void MappedFile::Close(){
+    if(data) munmap((void *)data, size);
+    data = nullptr;
+    size = 0;
+}
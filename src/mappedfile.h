@@ -0,0 +1,34 @@
+//
+//  mappedfile.h
+//  MathLinkBridge
+//
+//  A read-only memory mapping of a whole file. Batch evaluation of a script
+//  uses it to hand slices of the file to the link in place, so that even a
+//  script of several gigabytes is never copied into memory of our own.
+//
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+class MappedFile{
+public:
+    MappedFile() = default;
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    //Maps the file at path, unmapping any file mapped before. Returns false and sets Error() if it can't.
+    bool Open(const std::string &path);
+    void Close();
+
+    //The contents of the file. Valid until the file is closed.
+    std::string_view View() const { return std::string_view(data, size); }
+    const std::string &Error() const { return error; }
+
+private:
+    const char *data = nullptr;
+    size_t size = 0;
+    std::string error;
+};
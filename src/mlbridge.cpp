@@ -7,20 +7,27 @@
 //  Created by Robert Jacobson on 12/14/14.
 //  Copyright (c) 2014 Robert Jacobson. All rights reserved.
 //
-//  Note: Functions with an MMA- prefix are really MathLink/WSTP functions.
-//        The correct prefix (ML- or WS-) is determined at compile time with
-//        a macro. See config.h for details.
+//  Note: MLBridge never calls MathLink/WSTP directly. Everything goes through
+//        an ILink, which is a WSTPLink unless the user of MLBridge supplies
+//        another one. See link.h for details.
 
 #include <iostream>
 #include <utility>
-#include <wstp.h>
+#include <algorithm>
+#include <deque>
+#include <csignal>
+#include <cerrno>
+#include <charconv>
 
-// TODO: Handle signal interrupts correctly.
-//#include <signal.h>
 //TODO: Determine if stdlib is needed to free() memory linenoise allocates with malloc().
 //#include <stdlib.h>
 #include "linenoise.h"
 #include "mlbridge.h"
+#include "scanner.h"
+#include "jsonrecord.h"
+#ifdef MATHLINE_HAVE_MMA
+#include "wstplink.h"
+#endif
 
 //Used for printf() debugging.
 bool debug = false;
@@ -30,6 +37,42 @@ void DebugPrint(const std::string &msg){
 }
 
 
+static double MillisecondsSince(std::chrono::steady_clock::time_point start){
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+//Set by the SIGINT handler we install while the kernel is working on an evaluation.
+static volatile std::sig_atomic_t interruptRequested = 0;
+
+static void InterruptHandler(int){
+    interruptRequested = 1;
+}
+
+//Catches ctrl+c for as long as it lives, so that WaitForKernel() can forward it to the kernel rather than have it stop MathLine. A ctrl+c that arrives between packets is forwarded at the next wait.
+class ScopedInterruptHandler{
+public:
+    explicit ScopedInterruptHandler(bool install): installed(install){
+        if(!installed) return;
+        interruptRequested = 0;
+        previous = std::signal(SIGINT, InterruptHandler);
+    }
+    ~ScopedInterruptHandler(){
+        if(installed) std::signal(SIGINT, previous);
+    }
+    ScopedInterruptHandler(const ScopedInterruptHandler &) = delete;
+    ScopedInterruptHandler &operator=(const ScopedInterruptHandler &) = delete;
+
+private:
+    bool installed;
+    void (*previous)(int) = SIG_DFL;
+};
+
+//Polled by the link while it waits. Returning true aborts the wait so that we can forward the interrupt to the kernel.
+static bool InterruptRequested(){
+    return interruptRequested != 0;
+}
+
+
 MLBridgeException::MLBridgeException(std::string error, int errorCode):
     errorMsg(std::move(error)),
     errorCode(errorCode){
@@ -41,21 +84,39 @@ std::string MLBridgeException::ToString(){
 }
 
 
+//The input history is global to linenoise, so only the first MLBridge applies the default length. Otherwise every new MLBridge, such as a standby kernel's, would undo SetMaxHistory() calls made on the others.
+static std::once_flag historyInitialized;
+
 MLBridge::MLBridge(){
-    SetMaxHistory();
+    std::call_once(historyInitialized, [this]{ SetMaxHistory(); });
     argv = argvdefaults;
 }
 
 MLBridge::MLBridge(int newArgc, const char *newArgv[]){
-    SetMaxHistory();
+    std::call_once(historyInitialized, [this]{ SetMaxHistory(); });
     argc = newArgc;
     argv = newArgv;
 }
 
+MLBridge::MLBridge(std::unique_ptr<ILink> newLink): link(std::move(newLink)){
+    std::call_once(historyInitialized, [this]{ SetMaxHistory(); });
+    argv = argvdefaults;
+}
+
 MLBridge::~MLBridge(){
+    StopAsync();
+    //Let a standby that is still starting up finish, so that its link is closed properly.
+    if(standbyConnected.valid()) standbyConnected.wait();
+    standby.reset();
     Disconnect();
 }
 
+void MLBridge::SetLink(std::unique_ptr<ILink> newLink){
+    StopAsync();
+    Disconnect();
+    link = std::move(newLink);
+}
+
 void MLBridge::Connect(int newArgc, const char *newArgv[]){
     argc = newArgc;
     argv = newArgv;
@@ -63,70 +124,129 @@ void MLBridge::Connect(int newArgc, const char *newArgv[]){
 }
 
 void MLBridge::Connect(){
-    int error = MMAEOK;
+    int error;
+    //The I/O thread behind EvaluateAsync belongs to the previous connection.
+    StopAsync();
     connected = false;
+    connectTimings = MLBridgeConnectTimings();
 
     //If no parameters are specified and this has no default parameters, bail.
     if(argc==0 || argv==nullptr){
         throw MLBridgeException("No " MMANAME " parameters specified for the connection.");
     }
-    
-    //Initialize the link to Mathematica.
-    environment = MMAInitialize(nullptr);
-    if(environment == nullptr){
-        //Failed to initialize the link.
-        throw MLBridgeException("Cannot initialize " MMANAME ".");
+
+    if(!link){
+#ifdef MATHLINE_HAVE_MMA
+        link.reset(new WSTPLink());
+#else
+        throw MLBridgeException("MathLine was built without " MMANAME ". Supply a link with SetLink().");
+#endif
     }
+
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = connectTimeout > 0 ? start + std::chrono::milliseconds(connectTimeout) : std::chrono::steady_clock::time_point::max();
     
     //Open the link to Mathematica.
-    //link = MMAOpen(argc, (char **)argv);
-    DebugPrint("Calling WSOpenArgcArgv...");
-    link = MMAOpenArgcArgv( environment, argc, (char **)argv, &error);
-    DebugPrint("WSOpenArgcArgv returned: " + std::to_string(error));
-    if (link == nullptr || error != MMAEOK) {
+    DebugPrint("Opening link...");
+    error = link->Open(argc, argv);
+    DebugPrint("Open returned: " + std::to_string(error));
+    if (error != MMAEOK) {
         DebugPrint("Link is nullptr or error.");
         //The link failed to open.
         connected = false;
-        MMADeinitialize(environment);
         throw MLBridgeException("Cannot open " MMANAME " link.", error);
     }
-
-    //Activate the link. This blocks until the kernel is ready.
-    /*
-         TODO: MLActivate can block indefinitely. We should poll MLReady until it returns true or until we timeout before trying to call MLActivate.
-     */
-    if(!MMAActivate(link)) ErrorCheck();
-
-    /*
-    //Make sure we can connect through the link.
-    if (MMAReady(link) != true ){
-        //We're not connected.
-        connected = false;
-        MMAClose(link);
-        MMADeinitialize(environment);
-        throw MLBridgeException("Cannot connect to " MMANAME ".");
+    connectTimings.open = MillisecondsSince(start);
+
+    //Activate the link. MMAActivate blocks until the kernel is ready, possibly forever, so when we have a deadline we poll until the kernel shows up first.
+    start = std::chrono::steady_clock::now();
+    if(connectTimeout > 0){
+        auto pause = std::chrono::milliseconds(1);
+        while(!link->Ready()){
+            if(link->Error() != MMAEOK) ErrorCheck();
+            auto now = std::chrono::steady_clock::now();
+            if(now >= deadline){
+                Disconnect();
+                throw MLBridgeException("Timed out after " + std::to_string(connectTimeout) + " ms waiting for the kernel to activate the link.");
+            }
+            std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(pause, deadline - now));
+            //Back off, but not so far that we add noticeably to the kernel's startup time.
+            pause = std::min(2 * pause, std::chrono::milliseconds(5));
+        }
     }
-    */
+    if(!link->Activate()) ErrorCheck();
+    connectTimings.activate = MillisecondsSince(start);
 
     //Link is successful.
     connected = true;
 
     //Initialize the kernel (sets $PrePrint, etc.).
-    InitializeKernel();
+    InitializeKernel(deadline);
+    if(resultCache) resultCache->SetKernelVersion(EvaluateToString("$Version"));
+
+    if(keepStandby && !standby) StartStandby();
+}
+
+void MLBridge::StartStandby(){
+    standby.reset(standbyLinkFactory ? new MLBridge(standbyLinkFactory()) : new MLBridge());
+    standby->argc = argc;
+    standby->argv = argv;
+    standby->connectTimeout = connectTimeout;
+    standby->handleInterrupts = false;
+
+    MLBridge *newStandby = standby.get();
+    //Connect() throws if the kernel doesn't start. The future keeps the exception for SwitchToStandby() to find.
+    standbyConnected = std::async(std::launch::async, [newStandby]{ newStandby->Connect(); });
+}
+
+bool MLBridge::SwitchToStandby(){
+    if(!standby) return false;
+
+    try {
+        standbyConnected.get();
+    } catch (MLBridgeException &) {
+        standby.reset();
+        return false;
+    }
+
+    StopAsync();
+    Disconnect();
+    //Take over the standby's kernel along with the prompt it sent on startup.
+    link = std::move(standby->link);
+    kernelPrompt = std::move(standby->kernelPrompt);
+    standby->connected = false;
+    standby.reset();
+    connected = true;
+    running = false;
+    continueInput = false;
+    messageCount = 0;
+
+    if(keepStandby) StartStandby();
+    return true;
 }
 
 void MLBridge::Disconnect(){
-    if(connected){
-        MMAClose(link);
-        connected = false;
+    if(link) link->Close();
+    connected = false;
+}
+
+void MLBridge::WaitForStartup(std::chrono::steady_clock::time_point deadline, const std::string &phase){
+    if(connectTimeout <= 0) return;
+
+    ILink::WaitResult result = link->WaitForLinkActivity([deadline]{ return std::chrono::steady_clock::now() >= deadline; });
+    if(result == ILink::WaitAborted){
+        Disconnect();
+        throw MLBridgeException("Timed out after " + std::to_string(connectTimeout) + " ms waiting for the kernel to " + phase + ".");
     }
-    if(environment) MMADeinitialize(environment);
+    if(result == ILink::WaitError) ErrorCheck();
 }
 
-void MLBridge::InitializeKernel() {
+void MLBridge::InitializeKernel(std::chrono::steady_clock::time_point deadline) {
     int packet;
+    auto start = std::chrono::steady_clock::now();
 
     //The first thing the kernel does is send us an InputNamePacket.
+    WaitForStartup(deadline, "send its first prompt");
     packet = GetNextPacket();
     if(packet == INPUTNAMEPKT){
         kernelPrompt = GetUTF8String();
@@ -134,11 +254,48 @@ void MLBridge::InitializeKernel() {
         //Error condition, but not ILLEGALPKT or other link/kernel error.
         throw MLBridgeException("Kernel sent an unexpected packet (" + std::to_string(packet) + ") during initial startup.");
     }
-    SetPrePrint("InputForm");
+    connectTimings.firstPrompt = MillisecondsSince(start);
+
+    //This is SetPrePrint("InputForm"), except that we honor the deadline while we wait for the reply.
+    start = std::chrono::steady_clock::now();
+    EvaluateWithoutMainLoop("$PrePrint = InputForm", false);
+    running = false;
+    WaitForStartup(deadline, "set $PrePrint");
+    GetNextPacket();
+    connectTimings.prePrint = MillisecondsSince(start);
 }
 
-std::string MLBridge::ReadInput(){
-    std::string input;
+bool MLBridge::ReadInput(std::string &input){
+    std::string line;
+    //Whether the line we read continues an expression, either one the kernel told us is incomplete or one we are still collecting.
+    bool continuing = continueInput;
+
+    input.clear();
+    inputScanner.Reset();
+    while(true){
+        if(!ReadLine(continuing, line)){
+            //Whatever was read before the input ended is still evaluated. Otherwise the user cancelled the line with ctrl+c.
+            if(inputEnded && input.empty()) return false;
+            if(!inputEnded) input.clear();
+            break;
+        }
+        input.append(line);
+        //Text the kernel asks for, with InputString[] for example, isn't code.
+        if(!scanInput || inputMode != ExpressionMode) break;
+        
+        //Keep reading until the expression is complete instead of asking the kernel, which would have us send everything again with each line. The kernel still has the final say: if it reports Syntax::sntxi after all, continueInput takes over.
+        inputScanner.Feed(line);
+        inputScanner.Feed("\n");
+        if(inputScanner.IsComplete()) break;
+        input.push_back('\n');
+        continuing = true;
+    }
+    
+    kernelPrompt = "";
+    return true;
+}
+
+bool MLBridge::ReadLine(bool continuing, std::string &input){
     std::string promptToUser;
     
     if(showInOutStrings){
@@ -147,38 +304,52 @@ std::string MLBridge::ReadInput(){
         promptToUser = prompt;
     }
     
-    if(continueInput){
+    if(continuing){
         promptToUser.replace(0, promptToUser.length()-1, promptToUser.length(), ' ');
     }
 
     /*
      The user of this class may either use std::getline() or linenoise. The advantage of getline is that it can be used with something other than std::cin, while linenoise ignores pcin and always uses std::cin.
      */
-    if(useGetline){
+    if(useGetline || protocol == JSONLinesProtocol){
         std::istream &cin = *pcin;
         std::ostream &cout = *pcout;
         
-        cout << promptToUser;
+        if(protocol == JSONLinesProtocol){
+            //The prompt record is the client's cue to send the next line.
+            JSONRecord(cout, "prompt").AddString("text", showInOutStrings ? kernelPrompt : "").AddBoolean("continue", continuing);
+        } else{
+            cout << promptToUser;
+        }
+        cout.flush();
         
-        std::getline(cin, input);
-        //Check the status of cin.
-        if (!cin.good()){
-            //A ctrl+c event inside of getline introduces an internal error in cin. We attempt to clear the error.
+        errno = 0;
+        if(!std::getline(cin, input)){
+            //A ctrl+c event inside of getline interrupts the read and leaves an error in cin. We attempt to clear the error. Anything else means there is no more input.
             /*
              TODO: Generally cin is std::cin (it's the default), but it need not be. We should have a more robust way of dealing with ctrl+c while blocking in getline().
              */
+            inputEnded = errno != EINTR;
             cin.clear();
+            return false;
         }
     } else {
         char *line;
+        //linenoise writes to the terminal itself, so everything before it has to be out first.
+        pcout->flush();
+        errno = 0;
         line = linenoise(promptToUser.data());
+        //nullptr on ctrl+d or ctrl+c. linenoise sets errno to EAGAIN for ctrl+c.
+        if(line == nullptr){
+            inputEnded = errno != EAGAIN;
+            input.clear();
+            return false;
+        }
         linenoiseHistoryAdd(line);
         input = std::string(line);
         free(line);
     }
-    
-    kernelPrompt = "";
-    return input;
+    return true;
 }
 
 void MLBridge::SetMaxHistory(int max){
@@ -187,39 +358,319 @@ void MLBridge::SetMaxHistory(int max){
         throw MLBridgeException("Invalid maximum history length.");
 }
 
+MLBridgeOutputBuffer::MLBridgeOutputBuffer(std::streambuf *newDestination, size_t size):
+    destination(newDestination),
+    buffer(std::max<size_t>(size, 1)){
+    setp(buffer.data(), buffer.data() + buffer.size());
+}
+
+MLBridgeOutputBuffer::~MLBridgeOutputBuffer(){
+    sync();
+}
+
+bool MLBridgeOutputBuffer::Drain(){
+    std::streamsize size = pptr() - pbase();
+    bool drained = size == 0 || destination->sputn(pbase(), size) == size;
+    setp(buffer.data(), buffer.data() + buffer.size());
+    return drained;
+}
+
+MLBridgeOutputBuffer::int_type MLBridgeOutputBuffer::overflow(int_type c){
+    if(!Drain()) return traits_type::eof();
+    if(!traits_type::eq_int_type(c, traits_type::eof())){
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+std::streamsize MLBridgeOutputBuffer::xsputn(const char *s, std::streamsize n){
+    if(n <= epptr() - pptr()){
+        std::copy(s, s + n, pptr());
+        pbump((int)n);
+        return n;
+    }
+    if(!Drain()) return 0;
+    //Something this big gains nothing from the buffer.
+    if(n >= (std::streamsize)buffer.size()) return destination->sputn(s, n);
+    std::copy(s, s + n, pptr());
+    pbump((int)n);
+    return n;
+}
+
+int MLBridgeOutputBuffer::sync(){
+    bool drained = Drain();
+    return destination->pubsync() == 0 && drained ? 0 : -1;
+}
+
+//Routes an MLBridge's output through an MLBridgeOutputBuffer for as long as it lives.
+class ScopedOutputBuffer{
+public:
+    ScopedOutputBuffer(std::ostream *&newTarget, int size):
+        target(newTarget),
+        previous(newTarget),
+        buffer(newTarget->rdbuf(), size > 0 ? (size_t)size : 1),
+        stream(&buffer){
+        if(size > 0) target = &stream;
+    }
+    ~ScopedOutputBuffer(){
+        stream.flush();
+        target = previous;
+    }
+
+private:
+    std::ostream *&target;
+    std::ostream *previous;
+    MLBridgeOutputBuffer buffer;
+    std::ostream stream;
+};
+
 void MLBridge::REPL(){
+    ScopedOutputBuffer buffer(pcout, outputBufferSize);
     std::ostream &cout = *pcout;
     std::string input;
     
-    //For convenience we wrap everything in a try-block. However, some errors are recoverable. Though we do not do this, one could attempt to clear the error and restart the REPL.
+    //For convenience we wrap everything in a try-block. Errors from the link are fatal to the kernel, but if there is a standby kernel we carry on with that one.
+    while(true){
+        try {
+            while(true){
+                evaluationNumber++;
+                {
+                    TraceSpan span(tracer, "ReadInput", evaluationNumber);
+                    if(!ReadInput(input)) return;
+                }
+                if( input == "Exit" || input == "Exit[]" || input == "Quit" ) return;
+                TraceSpan span(tracer, "Evaluation", evaluationNumber);
+                {
+                    TraceSpan span(tracer, "Send", evaluationNumber);
+                    Evaluate(input);
+                }
+                //Read and act on response from the kernel.
+                ProcessKernelResponse();
+            }
+        } catch (MLBridgeException &e) {
+            PrintError(e);
+            if(!SwitchToStandby()) return;
+            if(protocol == JSONLinesProtocol){
+                JSONRecord(cout, "standby");
+            } else{
+                cout << "Switched to the standby kernel. The session history has been lost." << std::endl;
+            }
+        }
+    }
+}
+
+//Expressions read from a stream. Each is held here until the kernel has answered it.
+class StreamExpressions{
+public:
+    explicit StreamExpressions(std::istream &in): in(in) {}
+    bool Next(std::string_view &expression){
+        //A deque never moves its elements, so the views stay valid as it grows.
+        held.emplace_back();
+        if(!ReadExpression(in, held.back())){
+            held.pop_back();
+            return false;
+        }
+        expression = held.back();
+        return true;
+    }
+    void Retire(){ held.pop_front(); }
+
+private:
+    std::istream &in;
+    std::deque<std::string> held;
+};
+
+//Expressions sliced out of text that outlives them.
+class TextExpressions{
+public:
+    explicit TextExpressions(std::string_view text): text(text) {}
+    bool Next(std::string_view &expression){ return NextExpression(text, offset, expression); }
+    void Retire(){}
+
+private:
+    std::string_view text;
+    size_t offset = 0;
+};
+
+void MLBridge::Batch(std::istream &in){
+    StreamExpressions source(in);
+    BatchFrom(source);
+}
+
+void MLBridge::Batch(std::string_view text){
+    TextExpressions source(text);
+    BatchFrom(source);
+}
+
+template<typename Source>
+void MLBridge::BatchFrom(Source &source){
+    ScopedOutputBuffer buffer(pcout, outputBufferSize);
+    std::ostream &cout = *pcout;
+    std::string_view expression;
+    //The inputs we have sent but not yet seen the results of, oldest first. Inputs answered from the cache wait their turn here too, so that results come out in order.
+    struct Input{
+        std::string_view expression;
+        bool cached;
+        std::string result;
+    };
+    std::deque<Input> inFlight;
+    bool endOfInput = false;
+    //With the Main Loop, every result changes Out[#], so none of them can be cached.
+    bool useCache = resultCache && !useMainLoop;
+    //Set while a cache command waits in inFlight. Nothing after it is looked up until it has been carried out.
+    bool holdForCommand = false;
+    //Evaluations are numbered from here on, for the trace.
+    uint64_t sent = evaluationNumber;
+    uint64_t answered = evaluationNumber;
+    
+    //Batch input is never continued.
+    continueInput = false;
     try {
         while(true){
-            input = ReadInput();
-            if( input == "Exit" || input == "Exit[]" || input == "Quit" ) break;
-            Evaluate(input);
-            //Read and act on response from the kernel.
+            //Keep the pipeline full.
+            while(!endOfInput && !holdForCommand && inFlight.size() < (size_t)std::max(pipelineDepth, 1)){
+                if(!source.Next(expression) || expression == "Exit" || expression == "Exit[]" || expression == "Quit"){
+                    endOfInput = true;
+                    break;
+                }
+                inFlight.push_back(Input{expression, false, std::string()});
+                if(useCache && expression.find("MathLine`") != std::string_view::npos){
+                    //Possibly a cache command, carried out when its turn comes, after the results before it have been stored.
+                    holdForCommand = true;
+                } else if(useCache && ResultCache::IsCacheable(expression) && resultCache->Lookup(expression, inFlight.back().result)){
+                    inFlight.back().cached = true;
+                } else{
+                    TraceSpan span(tracer, "Send", sent + 1);
+                    PutInput(expression);
+                }
+                sent++;
+            }
+            if(inFlight.empty()) break;
+
+            //The kernel answers in the order we asked, so the next response belongs to the oldest input. Echo that input as if it had been typed at the prompt.
+            Input input = std::move(inFlight.front());
+            inFlight.pop_front();
+            //Inputs are answered in the order they were sent.
+            evaluationNumber = ++answered;
+            TraceSpan span(tracer, "Response", evaluationNumber);
+            inputString = input.expression;
+            source.Retire();
+            if(protocol == JSONLinesProtocol){
+                JSONRecord(cout, "input").AddString("prompt", showInOutStrings ? kernelPrompt : "").AddString("text", inputString);
+            } else{
+                cout << prompt << (showInOutStrings ? kernelPrompt : "") << inputString;
+            }
+            kernelPrompt = "";
+
+            if(input.cached){
+                PrintReturn(input.result);
+                continue;
+            }
+            if(holdForCommand && inFlight.empty()){
+                holdForCommand = false;
+                if(RunCacheCommand(inputString)){
+                    PrintReturn("Null");
+                    continue;
+                }
+                //Not one of ours after all, so it's for the kernel.
+                TraceSpan sendSpan(tracer, "Send", evaluationNumber);
+                PutInput(inputString);
+            }
+            running = true;
+            capturingResult = useCache;
+            capturedResult.clear();
+            responseHasOutput = false;
             ProcessKernelResponse();
+            capturingResult = false;
+            //A result is worth keeping only if it is all there was. $Aborted means we never saw the real one.
+            if(useCache && !responseHasOutput && capturedResult != "$Aborted" && ResultCache::IsCacheable(inputString)){
+                resultCache->Store(inputString, capturedResult);
+            }
+
+            //There is no more input to give an incomplete expression, so report it like any other syntax error.
+            if(continueInput){
+                continueInput = false;
+                PrintMessages();
+            }
         }
     } catch (MLBridgeException &e) {
-        cout << e.ToString() << std::endl;
+        capturingResult = false;
+        PrintError(e);
+    }
+}
+
+bool MLBridge::RunCacheCommand(std::string_view expression){
+    std::string command = ResultCache::Normalize(expression);
+    const std::string invalidate = "MathLine`InvalidateResultCache[\"";
+
+    if(command == "MathLine`ClearResultCache[]"){
+        resultCache->Clear();
+        return true;
     }
+    if(command.compare(0, invalidate.size(), invalidate) != 0 || command.size() < invalidate.size() + 2 || command.compare(command.size() - 2, 2, "\"]") != 0){
+        return false;
+    }
+    //The argument is a string literal. Undo its escapes to get the input back.
+    std::string input;
+    for(size_t i = invalidate.size(); i < command.size() - 2; i++){
+        if(command[i] == '\\' && i + 1 < command.size() - 2){
+            i++;
+        } else if(command[i] == '"'){
+            //The literal ends early, so this is something else.
+            return false;
+        }
+        input.push_back(command[i]);
+    }
+    resultCache->Invalidate(input);
+    return true;
+}
+
+void MLBridge::PrintError(MLBridgeException &e){
+    if(protocol == JSONLinesProtocol){
+        JSONRecord(*pcout, "error").AddString("text", e.ToString()).AddInteger("code", e.errorCode);
+    } else{
+        *pcout << e.ToString() << std::endl;
+    }
+}
+
+MLBridgeString::MLBridgeString(ILink *link, const unsigned char *buffer, int bytes):
+    link(link),
+    buffer(buffer),
+    bytes(bytes){
+    //Pass.
+}
+
+MLBridgeString::MLBridgeString(MLBridgeString &&other) noexcept:
+    link(other.link),
+    buffer(other.buffer),
+    bytes(other.bytes){
+    //The moved-from object must not release the buffer.
+    other.link = nullptr;
+}
+
+MLBridgeString::~MLBridgeString(){
+    if(link) link->ReleaseUTF8String(buffer, bytes);
 }
 
 std::string MLBridge::GetUTF8String(GetFunctionType func){
+    return std::string(GetUTF8View(func).View());
+}
+
+MLBridgeString MLBridge::GetUTF8View(GetFunctionType func){
     //func defaults to GetString.
     //MLGetUTF8String does NOT nullptr terminate the string.
     const unsigned char *stringBuffer = nullptr;
     int bytes = 0;
     int characters;
     int success = 0;
-    std::string output;
 
     //Wait until the kernel is ready.
-    MMAWaitForLinkActivity(link);
+    link->WaitForLinkActivity();
     
     switch(func){
         case GetString:
-            success = MMAGetUTF8String(link, &stringBuffer, &bytes, &characters);
+            success = link->GetUTF8String(&stringBuffer, &bytes, &characters);
             break;
             
         case GetFunction:
@@ -228,7 +679,7 @@ std::string MLBridge::GetUTF8String(GetFunctionType func){
             break;
             
         case GetSymbol:
-            success = MMAGetUTF8Symbol(link, &stringBuffer, &bytes, &characters);
+            success = link->GetUTF8Symbol(&stringBuffer, &bytes, &characters);
             break;
             
         case GetCharacters:
@@ -243,23 +694,63 @@ std::string MLBridge::GetUTF8String(GetFunctionType func){
         throw MLBridgeException("String expected but not read from" MMANAME ".");
     }
 
-    //Copy byte-for-byte into the output string buffer.
-    output.assign((char *)stringBuffer, bytes);
-    MMAReleaseUTF8String(link, stringBuffer, bytes);
-    
-    return output;
+    bytesRead += (uint64_t)bytes;
+    //The buffer is released when the MLBridgeString goes out of scope.
+    return MLBridgeString(link.get(), stringBuffer, bytes);
+}
+
+void MLBridge::WriteUTF8String(std::ostream &out, bool escapeJSON){
+    int remaining;
+    int bytes = 0;
+    int characters;
+
+    if(streamBufferSize <= 0){
+        if(escapeJSON){
+            JSONRecord::WriteEscaped(out, GetUTF8View().View());
+        } else{
+            out << GetUTF8View().View();
+        }
+        return;
+    }
+
+    //The buffer only grows if streamBufferSize does.
+    if(streamBuffer.size() < (size_t)streamBufferSize) streamBuffer.resize((size_t)streamBufferSize);
+    unsigned char *buffer = (unsigned char *)&streamBuffer[0];
+
+    //Wait until the kernel is ready.
+    link->WaitForLinkActivity();
+
+    //Pass each piece along as soon as we have it.
+    do {
+        if(!link->GetUTF8Characters(&remaining, buffer, streamBufferSize, &bytes, &characters)){
+            ErrorCheck(); //Disconnects on error.
+            throw MLBridgeException("String expected but not read from" MMANAME ".");
+        }
+        bytesRead += (uint64_t)bytes;
+        if(escapeJSON){
+            //Escapes never straddle pieces: a piece always ends on a whole UTF-8 character, and everything we escape is a single byte.
+            JSONRecord::WriteEscaped(out, std::string_view((const char *)buffer, (size_t)bytes));
+        } else{
+            out.write((const char *)buffer, bytes);
+        }
+    } while(remaining > 0);
 }
 
 int MLBridge::GetNextPacket(){
     int packet;
+    //If ProcessKernelResponse() has been waiting already, that counts too. Without statistics, don't read the clock at all.
+    std::chrono::steady_clock::time_point start;
+    if(packetStatistics) start = waitStarted == std::chrono::steady_clock::time_point() ? std::chrono::steady_clock::now() : waitStarted;
+    waitStarted = std::chrono::steady_clock::time_point();
 
     //Wait until the kernel is ready.
-    MMAWaitForLinkActivity(link);
+    link->WaitForLinkActivity();
 
     //MLNewPacket skips to the end of the current packet even if we are already at the end. It's never an error to call MLNewPacket(), but it is an error to call MLNextPacket if we aren't finished with the previous packet.
-    if(!MMANewPacket(link)) ErrorCheck();
-    packet = MMANextPacket(link);
+    if(!link->NewPacket()) ErrorCheck();
+    packet = link->NextPacket();
     if(packet == ILLEGALPKT) ErrorCheck();
+    if(packetStatistics) packetStatistics->RecordWait(packet, std::chrono::steady_clock::now() - start);
     
     return packet;
 }
@@ -271,13 +762,10 @@ void MLBridge::ErrorCheck(){
     if(link == nullptr){
         throw MLBridgeException("The " MMANAME " connection has been severed.", MMAEDEAD);
     }
-    errorCode = MMAError(link);
+    errorCode = link->Error();
     if(errorCode != MMAEOK){
-        const char *errormsg = MMAErrorMessage(link);
-        if(errormsg){
-            error = std::string(errormsg);
-            MMAReleaseErrorMessage(link, errormsg);
-        }else{
+        error = link->ErrorMessage();
+        if(error.empty()){
             error = "Kernel Error, but " MMANAME " did not return an error description.";
         }
         /*
@@ -296,7 +784,11 @@ void MLBridge::Evaluate(const std::string &input){
     } else{
         inputString = input;
     }
-    
+    PutInput(inputString);
+    running = true;
+}
+
+void MLBridge::PutInput(std::string_view input){
     /*
      There are two kinds of strings we can send to the kernel: strings of Mathematica code (the typical case) and strings of arbitrary text (in the case of the kernel requesting user input). In addition, there are two ways to ask the kernel to process Mathematica code: as part of the "Main Loop" in which In[#] and Out[#] variables are set, etc., which is typical of a human-usable REPL, or as NOT part of the "Main Loop," which is more appropriate in cases where session history need not be accessed or retained.
      */
@@ -304,25 +796,35 @@ void MLBridge::Evaluate(const std::string &input){
         //The user has input Mathematica code.
         if(useMainLoop){
             //Maintain session history for this evaluation.
-            MMAPutFunction(link, "EnterTextPacket", 1);
+            link->PutFunction("EnterTextPacket", 1);
         }else{
             //Bypass the kernel's Main Loop.
-            MMAPutFunction(link, "EvaluatePacket", 1);
-            MMAPutFunction(link, "ToString", 1);
-            MMAPutFunction(link, "ToExpression", 1);
+            link->PutFunction("EvaluatePacket", 1);
+            link->PutFunction("ToString", 1);
+            link->PutFunction("ToExpression", 1);
         }
         
     } else if(inputMode == TextMode){
         //The user has input arbitrary text, from example in response to an InputString[] call.
-        MMAPutFunction(link, "TextPacket", 1);
+        link->PutFunction("TextPacket", 1);
         //Turn off TextMode
         inputMode = ExpressionMode;
     }
-    MMAPutUTF8String(link, (const unsigned char *)inputString.data(), (int)inputString.size());
-    MMAEndPacket(link);
+    link->PutUTF8String((const unsigned char *)input.data(), (int)input.size());
+    link->EndPacket();
+    //We check for errors after sending a packet.
+    ErrorCheck();
+}
+
+void MLBridge::PutEvaluatePacket(const std::string &input, bool asString){
+    //Bypass the kernel's Main Loop.
+    link->PutFunction("EvaluatePacket", 1);
+    if(asString) link->PutFunction("ToString", 1);
+    link->PutFunction("ToExpression", 1);
+    link->PutUTF8String((const unsigned char *)input.data(), (int)input.size());
+    link->EndPacket();
     //We check for errors after sending a packet.
     ErrorCheck();
-    running = true;
 }
 
 void MLBridge::EvaluateWithoutMainLoop(const std::string &input, bool eatReturnPacket){
@@ -340,14 +842,7 @@ void MLBridge::EvaluateWithoutMainLoop(const std::string &input, bool eatReturnP
         inputString = input;
     }
     
-    //Bypass the kernel's Main Loop.
-    MMAPutFunction(link, "EvaluatePacket", 1);
-    MMAPutFunction(link, "ToString", 1);
-    MMAPutFunction(link, "ToExpression", 1);
-    MMAPutUTF8String(link, (const unsigned char *)inputString.data(), (int)inputString.size());
-    MMAEndPacket(link);
-    //We check for errors after sending a packet.
-    ErrorCheck();
+    PutEvaluatePacket(inputString);
     
     //The default is to discard the result.
     if(eatReturnPacket){
@@ -362,10 +857,21 @@ void MLBridge::SetPrePrint(const std::string &preprintfunction){
 }
 
 std::string MLBridge::GetKernelVersion() {
-    return GetEvaluated("$Version");
+    //Never from the cache: the cache needs to know the version.
+    return EvaluateToString("$Version");
 }
 
 std::string MLBridge::GetEvaluated(const std::string &expression){
+    std::string result;
+
+    if(!resultCache || !ResultCache::IsCacheable(expression)) return EvaluateToString(expression);
+    if(resultCache->Lookup(expression, result)) return result;
+    result = EvaluateToString(expression);
+    resultCache->Store(expression, result);
+    return result;
+}
+
+std::string MLBridge::EvaluateToString(const std::string &expression){
     
     EvaluateWithoutMainLoop(expression, false);
     //EvaluateWithoutMainLoop sets running to true, but we get the return string ourselves, so we leaving running = false;
@@ -381,11 +887,268 @@ std::string MLBridge::GetEvaluated(const std::string &expression){
     return GetUTF8String();
 }
 
+void MLBridge::EvaluateTo(const std::string &input, std::ostream &out){
+    std::ostream *previous = pcout;
+
+    pcout = &out;
+    try {
+        continueInput = false;
+        Evaluate(input);
+        ProcessKernelResponse();
+        //Nobody is going to supply the rest of an incomplete expression, so report it like any other syntax error.
+        if(continueInput){
+            continueInput = false;
+            PrintMessages();
+        }
+    } catch (MLBridgeException &) {
+        pcout = previous;
+        throw;
+    }
+    pcout = previous;
+}
+
+MLExpression MLBridge::EvaluateExpression(const std::string &input){
+    MLExpression result;
+
+    EvaluateForReturnPacket(input);
+    GetExpression(result);
+    return result;
+}
+
+void MLBridge::EvaluateForReturnPacket(const std::string &input){
+    if(!IsConnected()){
+        throw MLBridgeException("Tried to evaluate without being connected to a kernel.");
+    }
+
+    continueInput = false;
+    inputString = input;
+    PutEvaluatePacket(inputString, false);
+
+    //Anything before the result, messages for example, is skipped.
+    while(GetNextPacket() != RETURNPKT){
+        //Pass.
+    }
+}
+
+template<typename T>
+void MLBridge::PutArrayAs(const std::string &symbol, const T *data, const std::vector<int> &dimensions){
+    if(!IsConnected()){
+        throw MLBridgeException("Tried to evaluate without being connected to a kernel.");
+    }
+    if(dimensions.empty()){
+        throw MLBridgeException("An array needs at least one dimension.");
+    }
+
+    //EvaluatePacket[symbol = array; Null], so that the array doesn't come back to us.
+    link->PutFunction("EvaluatePacket", 1);
+    link->PutFunction("CompoundExpression", 2);
+    link->PutFunction("Set", 2);
+    link->PutSymbol(symbol.c_str());
+    link->PutArray(data, dimensions.data(), (int)dimensions.size());
+    link->PutSymbol("Null");
+    link->EndPacket();
+    //We check for errors after sending a packet.
+    ErrorCheck();
+
+    //Discard the Null.
+    GetNextPacket();
+}
+
+void MLBridge::PutArray(const std::string &symbol, const double *data, const std::vector<int> &dimensions){
+    PutArrayAs(symbol, data, dimensions);
+}
+
+void MLBridge::PutArray(const std::string &symbol, const long long *data, const std::vector<int> &dimensions){
+    PutArrayAs(symbol, data, dimensions);
+}
+
+template<typename T>
+MLBridgeArray<T> MLBridge::GetArrayAs(const std::string &input){
+    T *data = nullptr;
+    int *dimensions = nullptr;
+    char **heads = nullptr;
+    int depth = 0;
+
+    EvaluateForReturnPacket(input);
+    //Wait until the kernel is ready.
+    link->WaitForLinkActivity();
+    if(!link->GetArray(&data, &dimensions, &heads, &depth)){
+        ErrorCheck(); //Disconnects on error.
+        throw MLBridgeException("Array of numbers expected but not read from " MMANAME ".");
+    }
+    //The array is released when the MLBridgeArray goes out of scope.
+    return MLBridgeArray<T>(link.get(), data, dimensions, heads, depth);
+}
+
+MLBridgeArray<double> MLBridge::GetRealArray(const std::string &input){
+    return GetArrayAs<double>(input);
+}
+
+MLBridgeArray<long long> MLBridge::GetIntegerArray(const std::string &input){
+    return GetArrayAs<long long>(input);
+}
+
+void MLBridge::GetExpression(MLExpression &expression){
+    int count;
+
+    //Wait until the kernel is ready.
+    link->WaitForLinkActivity();
+
+    switch(link->GetNext()){
+        case MMATKINT:
+        {
+            //The kernel's integers are arbitrary precision. Read the digits rather than asking for 64 bits, which fails on a larger integer and takes the link down with it.
+            MLBridgeString digits = GetUTF8View(GetString);
+            std::string_view view = digits.View();
+            auto parsed = std::from_chars(view.data(), view.data() + view.size(), expression.integer);
+            if(parsed.ec == std::errc() && parsed.ptr == view.data() + view.size()){
+                expression.kind = MLExpression::Integer;
+                expression.text.clear();
+            } else{
+                expression.kind = MLExpression::BigInteger;
+                expression.text.assign(view.data(), view.size());
+            }
+            break;
+        }
+
+        case MMATKREAL:
+            expression.kind = MLExpression::Real;
+            if(!link->GetReal64(&expression.real)){
+                ErrorCheck();
+                throw MLBridgeException("Real number expected but not read from " MMANAME ".");
+            }
+            break;
+
+        case MMATKSTR:
+            expression.kind = MLExpression::String;
+            expression.text = GetUTF8View(GetString).View();
+            break;
+
+        case MMATKSYM:
+            expression.kind = MLExpression::Symbol;
+            expression.text = GetUTF8View(GetSymbol).View();
+            break;
+
+        case MMATKFUNC:
+            if(!link->GetArgCount(&count) || count < 0){
+                ErrorCheck();
+                throw MLBridgeException("Function expected but not read from " MMANAME ".");
+            }
+            expression.kind = MLExpression::Normal;
+            expression.parts.resize((size_t)count + 1);
+            //The head, then the arguments, each an expression in its own right.
+            for(MLExpression &part : expression.parts){
+                GetExpression(part);
+            }
+            return;
+
+        default:
+            ErrorCheck();
+            throw MLBridgeException("Expression expected but not read from " MMANAME ".");
+    }
+    expression.parts.clear();
+}
+
+std::future<std::string> MLBridge::EvaluateAsync(const std::string &expression){
+    std::future<std::string> future;
+
+    if(!IsConnected()){
+        throw MLBridgeException("Tried to evaluate without being connected to a kernel.");
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(asyncMutex);
+        asyncQueue.push_back(AsyncEvaluation{expression, std::promise<std::string>()});
+        future = asyncQueue.back().result.get_future();
+        if(!asyncRunning){
+            //A thread that gave up on a failed link has already let go of the lock for good, so it can be joined here.
+            if(asyncThread.joinable()) asyncThread.join();
+            asyncStopping = false;
+            asyncRunning = true;
+            asyncThread = std::thread(&MLBridge::AsyncLoop, this);
+        }
+    }
+    asyncWakeup = true;
+    asyncWork.notify_one();
+    return future;
+}
+
+void MLBridge::StopAsync(){
+    if(!asyncThread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(asyncMutex);
+        asyncStopping = true;
+    }
+    asyncWakeup = true;
+    asyncWork.notify_one();
+    asyncThread.join();
+}
+
+void MLBridge::AsyncLoop(){
+    //The evaluations we have sent, oldest first. The kernel answers in order.
+    std::deque<std::promise<std::string>> inFlight;
+    std::deque<AsyncEvaluation> toSend;
+
+    try {
+        while(true){
+            {
+                std::unique_lock<std::mutex> lock(asyncMutex);
+                asyncWork.wait(lock, [&]{ return asyncStopping || !asyncQueue.empty() || !inFlight.empty(); });
+                if(asyncStopping) break;
+                while(!asyncQueue.empty() && inFlight.size() + toSend.size() < (size_t)std::max(pipelineDepth, 1)){
+                    toSend.push_back(std::move(asyncQueue.front()));
+                    asyncQueue.pop_front();
+                }
+                asyncWakeup = false;
+            }
+
+            //Only this thread touches the link, so we don't hold the lock while we talk to the kernel.
+            while(!toSend.empty()){
+                PutEvaluatePacket(toSend.front().expression);
+                inFlight.push_back(std::move(toSend.front().result));
+                toSend.pop_front();
+            }
+            if(inFlight.empty()) continue;
+
+            //Sleep until the kernel answers, or until there is more to send.
+            if(!link->Flush()) ErrorCheck();
+            ILink::WaitResult result = link->WaitForLinkActivity([this]{ return asyncWakeup.load(); });
+            if(result == ILink::WaitAborted) continue;
+            if(result == ILink::WaitError) ErrorCheck();
+
+            //Anything other than the result itself (messages, for example) is skipped.
+            if(GetNextPacket() == RETURNPKT){
+                inFlight.front().set_value(GetUTF8String());
+                inFlight.pop_front();
+            }
+        }
+    } catch (MLBridgeException &e) {
+        //The link is gone, so nothing we've been asked to do can happen.
+        std::lock_guard<std::mutex> lock(asyncMutex);
+        for(auto &promise : inFlight) promise.set_exception(std::make_exception_ptr(e));
+        for(auto &evaluation : toSend) evaluation.result.set_exception(std::make_exception_ptr(e));
+        for(auto &evaluation : asyncQueue) evaluation.result.set_exception(std::make_exception_ptr(e));
+        inFlight.clear();
+        toSend.clear();
+        asyncQueue.clear();
+        asyncRunning = false;
+        return;
+    }
+
+    //We were asked to stop. Whatever is unfinished will never finish.
+    MLBridgeException stopped("MLBridge stopped before the evaluation finished.");
+    std::lock_guard<std::mutex> lock(asyncMutex);
+    for(auto &promise : inFlight) promise.set_exception(std::make_exception_ptr(stopped));
+    for(auto &evaluation : asyncQueue) evaluation.result.set_exception(std::make_exception_ptr(stopped));
+    asyncQueue.clear();
+    asyncRunning = false;
+}
+
 bool MLBridge::IsRunning(){
     //If we never started, there's nothing to do!
     if(!running) return false;
 
-    if(!MMAFlush(link) || !MMAReady(link)) {
+    if(!link->Flush() || !link->Ready()) {
         //Check if an error has occurred.
         ErrorCheck();
         running = true;
@@ -395,32 +1158,74 @@ bool MLBridge::IsRunning(){
     return running;
 }
 
+void MLBridge::WaitForKernel(){
+    ILink::WaitResult result;
+
+    //If we never started, there's nothing to wait for.
+    if(!running) return;
+
+    //Make sure the kernel actually has everything we've sent before we go to sleep.
+    {
+        TraceSpan span(tracer, "Flush", evaluationNumber);
+        if(!link->Flush()) ErrorCheck();
+    }
+
+    if(!handleInterrupts){
+        result = link->WaitForLinkActivity();
+        if(result != ILink::WaitSuccess) ErrorCheck();
+        running = false;
+        return;
+    }
+
+    //Sleep until the kernel has something for us. The callback wakes us up if the user asks for an interrupt. ProcessKernelResponse() has installed the SIGINT handler for the whole evaluation.
+    while((result = link->WaitForLinkActivity(InterruptRequested)) == ILink::WaitAborted){
+        DebugPrint("Sending interrupt to kernel.");
+        interruptRequested = 0;
+        link->PutInterruptMessage();
+    }
+
+    if(result != ILink::WaitSuccess) ErrorCheck();
+    running = false;
+}
+
+MLBridgeMessage &MLBridge::NewMessage(){
+    if(messageCount == messages.size()) messages.emplace_back();
+    MLBridgeMessage &message = messages[messageCount++];
+    //Setting position = -1 indicates that there is no associated error position with this message.
+    message.position = -1;
+    return message;
+}
+
 void MLBridge::PrintMessages(){
     std::ostream &cout = *pcout;
-    MLBridgeMessage *m;
-    
-    while(!messages.empty()){
-        //Only print if we aren't continuing previous input.
-        if(!continueInput){
-            m = messages.front();
-            cout << "\n" << m->message << std::endl;
-            if(m->position > -1){
+    TraceSpan span(messageCount > 0 ? tracer : nullptr, "PrintMessages", evaluationNumber);
+
+    //Only print if we aren't continuing previous input. Either way, we are done with the messages.
+    if(!continueInput){
+        for(size_t i = 0; i < messageCount; i++){
+            const MLBridgeMessage &m = messages[i];
+            if(protocol == JSONLinesProtocol){
+                JSONRecord record(cout, "message");
+                record.AddString("name", m.name).AddString("tag", m.tag).AddString("text", m.message);
+                if(m.position > -1) record.AddInteger("position", m.position);
+                continue;
+            }
+            cout << "\n" << m.message << "\n";
+            if(m.position > -1){
                 cout << inputString << "\n";
-                cout << std::string(m->position, '.');
-                cout << "^ Syntax Error.\n" << std::endl;
+                for(int dot = 0; dot < m.position; dot++) cout.put('.');
+                cout << "^ Syntax Error.\n\n";
             }
-            
-            delete m;
         }
-        messages.pop();
     }
+    messageCount = 0;
 }
 
 //The following represent In[#]:= strings and text that the kernel prints to the console respectively.
 bool MLBridge::ReceivedInputNamePacket(){
     
     DebugPrint("<INPUTNAMEPKT>");
-    if(!continueInput) *pcout << "\n\n";
+    if(!continueInput && protocol == TextProtocol) *pcout << "\n\n";
     if(showInOutStrings && useMainLoop){
         kernelPrompt = GetUTF8String();
     }
@@ -447,6 +1252,12 @@ bool MLBridge::ReceivedOutputNamePacket(){
     //Print any cached messages.
     PrintMessages();
     
+    if(protocol == JSONLinesProtocol){
+        outputPrompt = GetUTF8String();
+        JSONRecord(cout, "outputname").AddString("text", outputPrompt);
+        return false;
+    }
+
     cout << "\n";
     if(showInOutStrings){
         outputPrompt = GetUTF8String();
@@ -462,8 +1273,17 @@ bool MLBridge::ReceivedReturnTextPacket(){
 
     DebugPrint("<RETURNTEXTPKT>");
     
+    if(protocol == JSONLinesProtocol){
+        JSONRecord record(cout, "return");
+        record.BeginString("text");
+        WriteUTF8String(cout, true);
+        record.EndString();
+        return false;
+    }
+
     //Frankly, I'm not sure how to correctly format the output without starting to print it on a new line. There must be a way because Wolfram's interface does it.
-    cout << "\n" << GetUTF8String();
+    cout << "\n";
+    WriteUTF8String(cout);
     
     return false;
 }
@@ -477,12 +1297,32 @@ bool MLBridge::ReceivedReturnExpressionPacket(){
     //Print any cached messages.
     PrintMessages();
     
-    cout << GetUTF8String() << std::endl;
+    if(capturingResult){
+        //We need the whole result in hand for the cache.
+        capturedResult = GetUTF8View().View();
+        PrintReturn(capturedResult);
+    } else if(protocol == JSONLinesProtocol){
+        JSONRecord record(cout, "return");
+        record.BeginString("text");
+        WriteUTF8String(cout, true);
+        record.EndString();
+    } else{
+        WriteUTF8String(cout);
+        cout << "\n";
+    }
 
     //If we are using the Main Loop, we expect more packets from the kernel, so we keep done=false.
     return !useMainLoop;
 }
 
+void MLBridge::PrintReturn(std::string_view result){
+    if(protocol == JSONLinesProtocol){
+        JSONRecord(*pcout, "return").AddString("text", result);
+    } else{
+        *pcout << result << "\n";
+    }
+}
+
 //This packet typically contains the message (string) describing a syntax error.
 bool MLBridge::ReceivedTextPacket(){
     std::ostream &cout = *pcout;
@@ -491,7 +1331,11 @@ bool MLBridge::ReceivedTextPacket(){
     
     //We don't print if this text packet is for incomplete input syntax error.
     if(!continueInput){
-        cout << GetUTF8String();
+        if(protocol == JSONLinesProtocol){
+            JSONRecord(cout, "text").AddString("text", GetUTF8View().View());
+        } else{
+            cout << GetUTF8View().View();
+        }
     }
 
     return false;
@@ -501,28 +1345,80 @@ bool MLBridge::ReceivedTextPacket(){
 bool MLBridge::ReceivedDisplayPacket(){
     DebugPrint("<DISPLAYPKT>");
 
+    if(imageSink){
+        if(makeNewImage){
+            makeNewImage = false;
+            imageSink->Begin();
+        }
+        imageSink->Append(GetUTF8View().View());
+        return false;
+    }
+
     if(makeNewImage){
-        //If this is a new image (i.e. postscript string), create a new string to store the code.
+        //If this is a new image (i.e. postscript string), start a new string to store the code, reusing a spare buffer if we have one.
         makeNewImage = false;
-        image = new std::string();
+        if(!spareImages.empty()){
+            image = std::move(spareImages.back());
+            spareImages.pop_back();
+        }
+        image.clear();
+        image.reserve(std::max(imageSizeHint, lastImageSize));
         
         //If we want to include our own postscript preamble, this is where it would go.
     }
     
-    image->append(GetUTF8String());
+    image.append(GetUTF8View().View());
     
     return false;
 }
 
+void MLBridge::SetResultCache(std::unique_ptr<ResultCache> cache){
+    resultCache = std::move(cache);
+    if(resultCache && IsConnected()) resultCache->SetKernelVersion(EvaluateToString("$Version"));
+}
+
+void MLBridge::SetImageSink(std::unique_ptr<IImageSink> sink){
+    //Don't leave a half finished image behind in either place.
+    if(!makeNewImage){
+        if(imageSink) imageSink->End();
+        image.clear();
+        makeNewImage = true;
+    }
+    imageSink = std::move(sink);
+}
+
+void MLBridge::RecycleImage(std::string &&spent){
+    //A couple of spares is enough to keep up with a consumer that holds on to an image while the next one arrives.
+    if(spareImages.size() < 2){
+        spareImages.push_back(std::move(spent));
+    }
+}
+
 //This packet is received when the kernel is done sending postscript code.
 bool MLBridge::ReceivedDisplayEndPacket(){
     DebugPrint("<DISPLAYENDPKT>");
+
+    if(imageSink){
+        if(makeNewImage) imageSink->Begin();
+        imageSink->Append(GetUTF8View().View());
+        std::string handle = imageSink->End();
+        if(!handle.empty()){
+            if(protocol == JSONLinesProtocol) JSONRecord(*pcout, "image").AddString("handle", handle);
+            images.push(std::move(handle));
+        }
+        makeNewImage = true;
+        return false;
+    }
     
-    image->append(GetUTF8String());
+    image.append(GetUTF8View().View());
 
     //If we want to include our own postscript "post-amble", this is where it would go.
-    images.push(*image);
-    image = nullptr;
+    lastImageSize = image.size();
+    //Without a sink the image itself is the only handle there is.
+    if(protocol == JSONLinesProtocol) JSONRecord(*pcout, "image").AddString("postscript", image);
+    //The queue takes over the buffer. There's no copy, and image is left empty for the next one.
+    images.push(std::move(image));
+    image = std::string();
     makeNewImage = true;
     
     //It is unclear if we still return false when useMainLoop is false.
@@ -534,8 +1430,9 @@ bool MLBridge::ReceivedSyntaxPacket(){
     DebugPrint("<SYNTAXPKT>");
 
     //We cache syntax messages. This syntax packet must be associated to the last message cached. Record the position in that message's cache entry.
-    MLBridgeMessage *m = messages.back();
-    MMAGetInteger(link, &m->position);
+    if(messageCount > 0){
+        link->GetInteger(&messages[messageCount - 1].position);
+    }
     
     /*
      We don't throw an MLBridgeException because it's for errors associated to the link to the kernel, not for every possible error. Thus we do not throw an exception here. In fact, doing so would disrupt the internal state of the REPL. If one wishes to catch syntax errors, the best way is probably to implement a call-back function to handle them and call the function from here.
@@ -549,7 +1446,11 @@ bool MLBridge::ReceivedInputStringPacket(){
 
     DebugPrint("<INPUTSTRPKT>");
     
-    cout << GetUTF8String();
+    if(protocol == JSONLinesProtocol){
+        JSONRecord(cout, "inputstring").AddString("text", GetUTF8View().View());
+    } else{
+        cout << GetUTF8View().View();
+    }
     
     inputMode = TextMode;
     return true;
@@ -563,7 +1464,7 @@ bool MLBridge::ReceivedMenuPacket(){
     //What is this number? It seems to indicate that the kernel will subsequently output additional menu text, so we should expect it. (I think.) This happens when the user enters an invalid option at the Interrupt> menu.
     int interruptMenuNumber = 0;
     
-    MMAGetInteger(link, &interruptMenuNumber);
+    link->GetInteger(&interruptMenuNumber);
 
     kernelPrompt = GetUTF8String();
 
@@ -580,8 +1481,14 @@ bool MLBridge::ReceivedMenuPacket(){
         DebugPrint("<TEXTPKT>");
         
         //Get the menu text from the text packet and print it.
-        cout << GetUTF8String();
+        if(protocol == JSONLinesProtocol){
+            JSONRecord(cout, "menu").AddInteger("number", interruptMenuNumber).AddString("text", GetUTF8View().View());
+        } else{
+            cout << GetUTF8View().View();
+        }
         
+    } else if(protocol == JSONLinesProtocol){
+        JSONRecord(cout, "menu").AddInteger("number", interruptMenuNumber);
     } else{
         //Start on a new line.
         cout << "\n";
@@ -601,37 +1508,45 @@ bool MLBridge::ReceivedMessagePacket(){
      
      Is it true that we only ever get "Syntax" messages prior to "Syntax::sntxi"? If not, then the following code needs to be adjusted.
      */
-    MLBridgeMessage *message;
-    std::string symbolName = GetUTF8String(GetSymbol);
-    std::string tag = GetUTF8String();
-    
-    //Syntax::sntxi:
-    if(symbolName == "Syntax"){
-        if(tag == "sntxi"){
-            //Keep reading input.
-            continueInput = true;
-        }
-        //Make a new message to stash.
-        message = new MLBridgeMessage;
-        message->name = symbolName;
-        message->tag = tag;
-        //Setting position = -1 indicates that there is no associated error position with this message.
-        message->position = -1;
+    bool syntax;
+    {
+        MLBridgeString symbolName = GetUTF8View(GetSymbol);
+        MLBridgeString tag = GetUTF8View();
         
+        syntax = symbolName.View() == "Syntax";
+        if(syntax){
+            //Syntax::sntxi:
+            if(tag.View() == "sntxi"){
+                //Keep reading input.
+                continueInput = true;
+            }
+            //Stash the message in the next free cache entry.
+            MLBridgeMessage &message = NewMessage();
+            message.name.assign(symbolName.View());
+            message.tag.assign(tag.View());
+        } else if(protocol == JSONLinesProtocol){
+            //The views don't outlive this block, and the record needs them after we've read the text.
+            currentMessage.name.assign(symbolName.View());
+            currentMessage.tag.assign(tag.View());
+        }
+    }
+    
+    if(syntax){
         //Get the text of the message from the kernel.
         GetNextPacket();
         
-        message->message = GetUTF8String();
-        
-        //Stash the message.
-        messages.push(message);
+        messages[messageCount - 1].message.assign(GetUTF8View().View());
     } else if(!continueInput){
         //It's not a "Syntax::" message, and we haven't gotten a "Syntax::sntxi:" message, so go ahead and print any messages we've cached.
         PrintMessages();
         
         //Now get the text of this message from the kernel and print it.
         GetNextPacket();
-        cout << "\n" << GetUTF8String() << std::endl;
+        if(protocol == JSONLinesProtocol){
+            JSONRecord(cout, "message").AddString("name", currentMessage.name).AddString("tag", currentMessage.tag).AddString("text", GetUTF8View().View());
+        } else{
+            cout << "\n" << GetUTF8View().View() << "\n";
+        }
     }
     return false;
 }
@@ -640,9 +1555,13 @@ bool MLBridge::ReceivedMessagePacket(){
 bool MLBridge::ReceivedSuspendPacket(){
     DebugPrint("<SUSPENDPKT>");
     
-    MMANewPacket(link); //Do I need this line?
+    link->NewPacket(); //Do I need this line?
     
-    *pcout << "--suspended--" << std::endl;
+    if(protocol == JSONLinesProtocol){
+        JSONRecord(*pcout, "suspend");
+    } else{
+        *pcout << "--suspended--\n";
+    }
     
     return true;
 }
@@ -651,9 +1570,13 @@ bool MLBridge::ReceivedSuspendPacket(){
 bool MLBridge::ReceivedResumePacket(){
     DebugPrint("<RESUMEPKT>");
     
-    *pcout << "--resumed--" << std::endl;
+    if(protocol == JSONLinesProtocol){
+        JSONRecord(*pcout, "resume");
+    } else{
+        *pcout << "--resumed--\n";
+    }
     
-    MMANewPacket(link); //Do I need this line?
+    link->NewPacket(); //Do I need this line?
     
     return false;
 }
@@ -663,8 +1586,12 @@ bool MLBridge::ReceivedBeginDialogPacket(){
     DebugPrint("<BEGINDLGPKT>");
     
     int dialogLevel;
-    MMAGetInteger(link, &dialogLevel);
-    *pcout << "entering dialog:" << dialogLevel << std::endl;
+    link->GetInteger(&dialogLevel);
+    if(protocol == JSONLinesProtocol){
+        JSONRecord(*pcout, "begindialog").AddInteger("level", dialogLevel);
+    } else{
+        *pcout << "entering dialog:" << dialogLevel << "\n";
+    }
     
     return false;
 }
@@ -673,24 +1600,50 @@ bool MLBridge::ReceivedEndDialogPacket(){
     DebugPrint("<ENDDLGPKT>");
     
     int dialogLevel;
-    MMAGetInteger(link, &dialogLevel);
+    link->GetInteger(&dialogLevel);
     dialogLevel--;
-    *pcout << "leaving dialog:" << dialogLevel << std::endl;
+    if(protocol == JSONLinesProtocol){
+        JSONRecord(*pcout, "enddialog").AddInteger("level", dialogLevel);
+    } else{
+        *pcout << "leaving dialog:" << dialogLevel << "\n";
+    }
     
     return false;
 }
 
 void MLBridge::ProcessKernelResponse() {
     bool done = false;
+    bool firstPacket = true;
     std::string output;
+    bool timing = packetStatistics || tracer;
+    //While the kernel works on this evaluation, ctrl+c should interrupt its computation rather than MathLine. Installed once here rather than around every wait, since an evaluation can take thousands of packets.
+    ScopedInterruptHandler interrupts(handleInterrupts && blockingWait);
 
     //Keep fetching packets until the kernel is finished responding.
     do {
-        //We poll to see if MLNextPacket will block. If it will, just return true. We don't want to spend time blocking in MLNextPacket because we want to be able to send an MLInterruptMessage if we need to.
-        while(IsRunning() );
+        if(timing) waitStarted = std::chrono::steady_clock::now();
+        auto waitStart = waitStarted;
+
+        //Let the user see everything so far before we sit and wait for more.
+        if(!link->Ready()) pcout->flush();
+
+        //We don't want to spend time blocking in MLNextPacket because we want to be able to send an MLInterruptMessage if we need to. Either sleep on the link with an interruptible wait, or poll to see if MLNextPacket will block.
+        if(blockingWait){
+            WaitForKernel();
+        } else{
+            while(IsRunning() );
+        }
 
         //Get the next packet.
         int packet = GetNextPacket();
+        if(packet != RETURNPKT && packet != RETURNEXPRPKT) responseHasOutput = true;
+        auto received = timing ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+        uint64_t bytesBefore = bytesRead;
+        if(tracer){
+            tracer->Complete("Wait", waitStart, received, evaluationNumber);
+            if(firstPacket) tracer->Instant("FirstPacket", received, evaluationNumber);
+        }
+        firstPacket = false;
 
         // TODO: Received*Packet() returns a bool indicating whether or not the loop in this method should continue. That's stupid. Those bools should exist in the case statements themselves, and Received*Packet() should just process the received packet.
         switch (packet) {
@@ -754,6 +1707,12 @@ void MLBridge::ProcessKernelResponse() {
                 break;
         } //End switch.
 
+        if(timing){
+            auto handled = std::chrono::steady_clock::now();
+            if(packetStatistics) packetStatistics->RecordHandling(packet, handled - received, bytesRead - bytesBefore);
+            if(tracer) tracer->Complete(PacketStatistics::PacketName(packet), received, handled, evaluationNumber);
+        }
+
         //Print any cached messages we haven't printed yet.
         if (done) PrintMessages();
 
@@ -12,10 +12,29 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <queue>
 #include <exception>
+#include <memory>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <streambuf>
 
 #include "config.h"
+#include "link.h"
+#include "imagesink.h"
+#include "expression.h"
+#include "scanner.h"
+#include "resultcache.h"
+#include "packetstats.h"
+#include "tracer.h"
 
 struct MLBridgeException: public std::exception{
     MLBridgeException(std::string errorMsg, int errorCode = 0);
@@ -31,6 +50,100 @@ struct MLBridgeMessage{
     int position;
 };
 
+//How long each phase of Connect() took, in milliseconds.
+struct MLBridgeConnectTimings{
+    //Launching the kernel (MMAOpenArgcArgv).
+    double open = 0;
+    //Waiting for the kernel to come up on the other end of the link (MMAActivate).
+    double activate = 0;
+    //Waiting for the kernel's first INPUTNAMEPKT.
+    double firstPrompt = 0;
+    //Setting $PrePrint.
+    double prePrint = 0;
+
+    double Total() const { return open + activate + firstPrompt + prePrint; }
+};
+
+/*
+ A string that still lives in the link's buffer. The view is valid until this object goes out of scope, at which point the buffer is released back to the link. Use it to write kernel output somewhere without first copying it into a std::string.
+ */
+class MLBridgeString{
+public:
+    MLBridgeString(ILink *link, const unsigned char *buffer, int bytes);
+    MLBridgeString(MLBridgeString &&other) noexcept;
+    MLBridgeString(const MLBridgeString &) = delete;
+    MLBridgeString &operator=(const MLBridgeString &) = delete;
+    MLBridgeString &operator=(MLBridgeString &&) = delete;
+    ~MLBridgeString();
+
+    std::string_view View() const { return std::string_view((const char *)buffer, (size_t)bytes); }
+    operator std::string_view() const { return View(); }
+
+private:
+    ILink *link;
+    const unsigned char *buffer;
+    int bytes;
+};
+
+/*
+ A numeric array that still lives in the link's buffer, like MLBridgeString. Elements are in row major order. T is double or long long.
+ */
+template<typename T>
+class MLBridgeArray{
+public:
+    MLBridgeArray(ILink *link, T *data, int *dimensions, char **heads, int depth):
+        link(link), data(data), dimensions(dimensions), heads(heads), depth(depth) {}
+    MLBridgeArray(MLBridgeArray &&other) noexcept:
+        link(other.link), data(other.data), dimensions(other.dimensions), heads(other.heads), depth(other.depth){
+        //The moved-from object must not release the array.
+        other.link = nullptr;
+    }
+    MLBridgeArray(const MLBridgeArray &) = delete;
+    MLBridgeArray &operator=(const MLBridgeArray &) = delete;
+    MLBridgeArray &operator=(MLBridgeArray &&) = delete;
+    ~MLBridgeArray(){
+        if(link) link->ReleaseArray(data, dimensions, heads, depth);
+    }
+
+    const T *Data() const { return data; }
+    //The length of each level, outermost first.
+    const int *Dimensions() const { return dimensions; }
+    int Depth() const { return depth; }
+    //The total number of elements.
+    size_t Size() const {
+        size_t size = 1;
+        for(int i = 0; i < depth; i++) size *= (size_t)dimensions[i];
+        return size;
+    }
+
+private:
+    ILink *link;
+    T *data;
+    int *dimensions;
+    char **heads;
+    int depth;
+};
+
+/*
+ Collects everything written to it and passes it on to another stream buffer in large pieces, when the buffer fills up or is flushed. MLBridge flushes it when the user needs to see the output, that is, just before it waits on the kernel or the user, rather than after every line, so that a burst of kernel output costs one write instead of one per line.
+ */
+class MLBridgeOutputBuffer: public std::streambuf{
+public:
+    MLBridgeOutputBuffer(std::streambuf *destination, size_t size);
+    ~MLBridgeOutputBuffer() override;
+
+protected:
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char *s, std::streamsize n) override;
+    int sync() override;
+
+private:
+    std::streambuf *destination;
+    std::vector<char> buffer;
+    //Hands what we have to destination. Returns false if it wouldn't take all of it.
+    bool Drain();
+};
+
 class MLBridge {
 public:
     //Parameters affecting how to communicate with the user and kernel.
@@ -39,6 +152,31 @@ public:
     bool useMainLoop = true;
     bool showInOutStrings = true;
     bool useGetline = false;
+    //If true, we block (without spinning) while the kernel computes. If false, we poll the link in a tight loop.
+    bool blockingWait = true;
+    //If true, ctrl+c while we wait on the kernel is forwarded to it as an interrupt. Only one MLBridge per process should do this.
+    bool handleInterrupts = true;
+    //If positive, results are streamed to pcout in pieces of at most this many bytes rather than read into memory whole. This caps how much of a huge result MathLine holds at once.
+    int streamBufferSize = 0;
+    //The number of inputs Batch() keeps in flight to the kernel at once.
+    int pipelineDepth = 16;
+    //If positive, REPL() and Batch() collect output in a buffer of this many bytes and write it out in large pieces. The buffer is flushed whenever we are about to wait for the kernel or the user. Zero writes through to pcout directly.
+    int outputBufferSize = 64 * 1024;
+    //How output is written to pcout. TextProtocol is meant for people. JSONLinesProtocol writes each piece of output (prompts, results, messages, text, images) as a JSON object on a line of its own, for programs driving MathLine. See jsonrecord.h.
+    enum Protocol {TextProtocol, JSONLinesProtocol};
+    Protocol protocol = TextProtocol;
+    //If positive, Connect() gives up if the kernel isn't up and initialized after this many milliseconds. Otherwise Connect() waits as long as it takes.
+    int connectTimeout = 0;
+    //If true, ReadInput() keeps reading lines until they form a complete expression, as far as ExpressionScanner can tell, before anything is sent to the kernel. If false, every line is sent as it is read, and the kernel tells us (Syntax::sntxi) when an expression is incomplete.
+    bool scanInput = true;
+    //If true, Connect() launches a second, standby kernel in the background, so that a dead kernel can be replaced at once with SwitchToStandby().
+    bool keepStandby = false;
+    //If set, every packet received is counted and timed here. See packetstats.h. It is shared, so several MLBridges can report to one.
+    PacketStatistics *packetStatistics = nullptr;
+    //If set, REPL() and Batch() record a timeline of each evaluation here. See tracer.h.
+    EvaluationTracer *tracer = nullptr;
+    //Supplies the standby kernel's link, e.g. a MockLink. By default the standby gets a WSTPLink opened with argc and argv.
+    std::function<std::unique_ptr<ILink>()> standbyLinkFactory;
     
     int argc = 4;
     const char *argvdefaults[4] = {"MathLine",
@@ -54,58 +192,184 @@ public:
      
      To use this feature you must evaluate '$Display = "stdout"'.
      
+     With an image sink (see SetImageSink()), the entries are the handles the sink returns instead, e.g. file names.
      */
     std::queue<std::string> images;
+    //The expected size of an image in bytes, if known. The buffer for each new image is reserved at least this large, so a typical image is received without reallocating. Otherwise we go by the size of the last image.
+    size_t imageSizeHint = 0;
+    //Hands the buffer of an image taken from images back to be reused for the next one.
+    void RecycleImage(std::string &&spent);
+    //Sends images to sink as they arrive rather than collecting them in memory. Pass nullptr to go back to collecting them in memory.
+    void SetImageSink(std::unique_ptr<IImageSink> sink);
+    /*
+     Serves GetEvaluated() and, when the Main Loop isn't used, Batch() from cache where it can, and adds the results of new evaluations to it. Inputs that ResultCache::IsCacheable() turns away are always evaluated. Batch() only caches results that came without messages or other output, so a hit prints exactly what the kernel would have; GetEvaluated() caches the string it returns, since messages never reach its caller anyway. Pass nullptr to stop caching.
+     
+     Batch() also takes two commands of its own while caching, in order with the inputs around them: MathLine`ClearResultCache[] empties the cache, and MathLine`InvalidateResultCache["input"] forgets the result for input.
+     */
+    void SetResultCache(std::unique_ptr<ResultCache> cache);
+    ResultCache *GetResultCache() { return resultCache.get(); }
     
     
     MLBridge();
     MLBridge(int argc, const char *argv[]);
+    //Talk to the kernel through the given link instead of opening a WSTPLink, e.g. a MockLink.
+    explicit MLBridge(std::unique_ptr<ILink> link);
     ~MLBridge();
 
+    //Replaces the link used by the next call to Connect().
+    void SetLink(std::unique_ptr<ILink> newLink);
+
     void Connect(int argc, const char *argv[]);
     void Connect();
     bool IsConnected(){ return connected; }
+    //How long the last call to Connect() spent in each phase.
+    const MLBridgeConnectTimings &GetConnectTimings() const { return connectTimings; }
     void Disconnect();
+    /*
+     Replaces the current kernel with the standby kernel, which is already up and initialized, and starts warming up a new standby in the background. Returns false if there is no standby kernel or it failed to start. REPL() calls this when the link to the kernel dies, but the new kernel starts with a fresh session: In[#]/Out[#] and any definitions are gone.
+     */
+    bool SwitchToStandby();
 
     bool IsRunning();
     void REPL();
+    //Evaluates every complete expression read from in, then returns. Unlike REPL(), we don't wait for a result before sending the next input.
+    void Batch(std::istream &in);
+    //Like Batch(in), but the expressions are found in text and sent to the kernel straight from it, without copying. text must stay valid until Batch returns. See MappedFile.
+    void Batch(std::string_view text);
     void SetMaxHistory(int max = 10);
     void SetPrePrint(const std::string &preprintfunction);
     std::string GetKernelVersion();
     std::string GetEvaluated(const std::string &expression);
+    /*
+     Evaluates expression outside of the Main Loop without blocking the caller. The future receives the result as a string, or an MLBridgeException. Any number of evaluations may be in flight at once: a single background I/O thread sends them to the kernel, up to pipelineDepth at a time, and hands each result to its future as it arrives. Messages the kernel sends along the way are discarded.
+     
+     While evaluations are in flight, the background thread owns the link, so don't call anything else on this MLBridge.
+     */
+    std::future<std::string> EvaluateAsync(const std::string &expression);
+    //Evaluates input just as REPL() would, but writes everything the kernel prints in response to out instead of pcout.
+    void EvaluateTo(const std::string &input, std::ostream &out);
+    /*
+     Evaluates input outside of the Main Loop and returns the result as an expression tree, read with the link's native get calls. Unlike GetEvaluated(), the kernel never formats the result as text, so numbers arrive as numbers. Messages the kernel sends along the way are discarded. An integer that doesn't fit in 64 bits comes back as a BigInteger holding its digits.
+     */
+    MLExpression EvaluateExpression(const std::string &input);
+    /*
+     Assigns a packed array to symbol, in the kernel's global context unless symbol says otherwise, without formatting the numbers as text. data holds the elements in row major order and is read in place; dimensions gives the length of each level, so {1000} is a vector and {100, 10} a matrix.
+     */
+    void PutArray(const std::string &symbol, const double *data, const std::vector<int> &dimensions);
+    void PutArray(const std::string &symbol, const long long *data, const std::vector<int> &dimensions);
+    /*
+     Evaluates input outside of the Main Loop and reads the result, which must be a rectangular array of numbers (ideally a packed array), straight out of the link's buffer. Integers are converted if reals are asked for, but not the other way around. Throws MLBridgeException if the result is anything else.
+     */
+    MLBridgeArray<double> GetRealArray(const std::string &input);
+    MLBridgeArray<long long> GetIntegerArray(const std::string &input);
     
 private:
-    //Variables to keep track of state.
-    bool connected = false;
+    //Variables to keep track of state. AsyncLoop can disconnect on a link error while the owner polls IsConnected(), so connected is atomic.
+    std::atomic<bool> connected{false};
     bool running = false;
     //The following is set to true when an "incomplete expression" syntax error occurs, as it indicates that more input is needed.
     bool continueInput = false;
     enum {ExpressionMode, TextMode} inputMode = ExpressionMode;
-    //Holds the image data (postscript code) as we receive it from the kernel until we have it all.
-    std::string *image = nullptr;
+    //Holds the image data (postscript code) as we receive it from the kernel until we have it all. It is moved into images when complete.
+    std::string image;
+    //Buffers returned by RecycleImage(), waiting to hold the next image.
+    std::vector<std::string> spareImages;
+    size_t lastImageSize = 0;
+    std::unique_ptr<IImageSink> imageSink;
     bool makeNewImage = true;
     //The last input string we sent to the kernel.
     std::string inputString;
     std::string outputPrompt;
-    //Syntax messages are cached. 
-    std::queue<MLBridgeMessage*> messages;
+    MLBridgeConnectTimings connectTimings;
+    //Reused by WriteUTF8String when streaming.
+    std::string streamBuffer;
+    //Syntax messages are cached. The first messageCount entries are in use. Entries are reused, strings and all, from one input to the next, so caching a message normally allocates nothing.
+    std::vector<MLBridgeMessage> messages;
+    size_t messageCount = 0;
+    //Holds a message that isn't cached while we read its text, for the JSON Lines protocol.
+    MLBridgeMessage currentMessage;
+    //Reports an MLBridgeException caught by REPL() or Batch().
+    void PrintError(MLBridgeException &e);
+    MLBridgeMessage &NewMessage();
     
-    MMALINK link = nullptr;
-    MMAEnvironment environment = nullptr;
+    std::unique_ptr<ILink> link;
+
+    //The standby kernel is just another MLBridge, connected by a background task.
+    std::unique_ptr<MLBridge> standby;
+    std::future<void> standbyConnected;
+    void StartStandby();
+
+    //State shared with the I/O thread behind EvaluateAsync.
+    struct AsyncEvaluation{
+        std::string expression;
+        std::promise<std::string> result;
+    };
+    std::thread asyncThread;
+    std::mutex asyncMutex;
+    std::condition_variable asyncWork;
+    std::deque<AsyncEvaluation> asyncQueue;
+    //Set when there is something for the I/O thread to do. Polled while it waits on the link.
+    std::atomic<bool> asyncWakeup{false};
+    bool asyncStopping = false;
+    //Whether the I/O thread is still taking work. It stops by itself when the link fails, leaving asyncThread to be joined.
+    bool asyncRunning = false;
+    void AsyncLoop();
+    void StopAsync();
     
     void ErrorCheck();
-    std::string ReadInput();
+    void WaitForKernel();
+    //Reads an expression from the user, which may take several lines. Returns false once there is no more input, which ends the REPL just like Exit.
+    bool ReadInput(std::string &input);
+    //Reads one line, prompting for a continuation line if continuing. Returns false if no line was read, either because the user pressed ctrl+c or because there is no more input, in which case inputEnded is set.
+    bool ReadLine(bool continuing, std::string &input);
+    bool inputEnded = false;
+    std::unique_ptr<ResultCache> resultCache;
+    //For packetStatistics: the bytes of strings read from the link so far, and when we started waiting for the next packet, if ProcessKernelResponse() did.
+    uint64_t bytesRead = 0;
+    std::chrono::steady_clock::time_point waitStarted;
+    //Numbers the inputs REPL() and Batch() evaluate, to tie each span in the trace to its evaluation.
+    uint64_t evaluationNumber = 0;
+    //While capturingResult is set, the result the kernel returns is kept in capturedResult, and responseHasOutput records whether anything else came with it.
+    bool capturingResult = false;
+    std::string capturedResult;
+    bool responseHasOutput = false;
+    //Evaluates expression outside of the Main Loop and returns the result. GetEvaluated() without the cache.
+    std::string EvaluateToString(const std::string &expression);
+    //Carries out expression and returns true if it is one of the result cache commands Batch() handles itself. See SetResultCache().
+    bool RunCacheCommand(std::string_view expression);
+    //Writes a result the way ReceivedReturnExpressionPacket() does.
+    void PrintReturn(std::string_view result);
+    //Tracks the lines ReadInput() has read so far. Each line is scanned once.
+    ExpressionScanner inputScanner;
     void PrintMessages();
-    void InitializeKernel();
+    void InitializeKernel(std::chrono::steady_clock::time_point deadline);
+    //Waits until the link has something for us, throwing MLBridgeException if the connectTimeout deadline passes first. phase describes what we are waiting for.
+    void WaitForStartup(std::chrono::steady_clock::time_point deadline, const std::string &phase);
 
     // Evaluation with REPL.
     void Evaluate(const std::string &input);
+    //Sends input the way Evaluate does, without recording it in inputString.
+    void PutInput(std::string_view input);
+    //The loop behind both Batch()es. Source provides Next(std::string_view &expression), whose result stays valid until Retire() is called for it, oldest first.
+    template<typename Source> void BatchFrom(Source &source);
     //Skips the Main Loop regardless of the state of useMainLoop.
     void EvaluateWithoutMainLoop(const std::string &input, bool eatReturnPacket = true);
+    //Sends EvaluatePacket[ToString[ToExpression[input]]], or EvaluatePacket[ToExpression[input]] if asString is false.
+    void PutEvaluatePacket(const std::string &input, bool asString = true);
+    //Reads the next expression on the link into expression, which is reused.
+    void GetExpression(MLExpression &expression);
+    template<typename T> void PutArrayAs(const std::string &symbol, const T *data, const std::vector<int> &dimensions);
+    template<typename T> MLBridgeArray<T> GetArrayAs(const std::string &input);
+    //Sends input without the ToString wrapper and skips everything before the kernel's RETURNPKT.
+    void EvaluateForReturnPacket(const std::string &input);
 
     //Convenience wrapper for MLGetUTF8String, etc..
     enum GetFunctionType {GetString, GetFunction, GetSymbol, GetCharacters};
     std::string GetUTF8String(GetFunctionType func = GetString);
+    //Like GetUTF8String, but without the copy. See MLBridgeString.
+    MLBridgeString GetUTF8View(GetFunctionType func = GetString);
+    //Writes the next string on the link to out, streaming it if streamBufferSize is positive.
+    void WriteUTF8String(std::ostream &out, bool escapeJSON = false);
     int GetNextPacket();
     
     //These are the packets this code knows how to handle. Each returns whether no more packets are expected from the kernel.
@@ -0,0 +1,727 @@
+//
+//  mocklink.cpp
+//  MathLinkBridge
+//
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <cstdint>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <utility>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "mocklink.h"
+#include "mlbridge.h"
+
+//How often we poll the abort callback while waiting.
+static const int pollMilliseconds = 50;
+
+static const struct {const char *name; int type;} packetNames[] = {
+    {"ILLEGALPKT", ILLEGALPKT}, {"INPUTPKT", INPUTPKT}, {"TEXTPKT", TEXTPKT},
+    {"RETURNPKT", RETURNPKT}, {"RETURNTEXTPKT", RETURNTEXTPKT}, {"MESSAGEPKT", MESSAGEPKT},
+    {"MENUPKT", MENUPKT}, {"CALLPKT", CALLPKT}, {"INPUTNAMEPKT", INPUTNAMEPKT},
+    {"OUTPUTNAMEPKT", OUTPUTNAMEPKT}, {"SYNTAXPKT", SYNTAXPKT}, {"DISPLAYPKT", DISPLAYPKT},
+    {"DISPLAYENDPKT", DISPLAYENDPKT}, {"EVALUATEPKT", EVALUATEPKT}, {"ENTERTEXTPKT", ENTERTEXTPKT},
+    {"ENTEREXPRPKT", ENTEREXPRPKT}, {"RETURNEXPRPKT", RETURNEXPRPKT}, {"SUSPENDPKT", SUSPENDPKT},
+    {"RESUMEPKT", RESUMEPKT}, {"BEGINDLGPKT", BEGINDLGPKT}, {"ENDDLGPKT", ENDDLGPKT},
+    {"INPUTSTRPKT", INPUTSTRPKT}
+};
+
+//The packet heads MLBridge sends, so that recorded requests carry a packet type just like replies do.
+static const struct {const char *head; int type;} requestHeads[] = {
+    {"EnterTextPacket", ENTERTEXTPKT}, {"EnterExpressionPacket", ENTEREXPRPKT},
+    {"EvaluatePacket", EVALUATEPKT}, {"TextPacket", TEXTPKT}
+};
+
+
+/*
+ Script parsing.
+ */
+
+static MockToken ParseWord(const std::string &word, int lineNumber){
+    MockToken token;
+    char *end = nullptr;
+
+    //Integer? The digits are kept too, for one too large for 64 bits, which can only be read as a string.
+    long long integer = std::strtoll(word.c_str(), &end, 10);
+    if(end && *end == '\0'){
+        token.kind = MockToken::Integer;
+        token.integer = integer;
+        token.text = word;
+        return token;
+    }
+    //Real?
+    double real = std::strtod(word.c_str(), &end);
+    if(end && *end == '\0'){
+        token.kind = MockToken::Real;
+        token.real = real;
+        return token;
+    }
+    //Function head with an argument count, e.g. List[3]?
+    size_t bracket = word.find('[');
+    if(bracket != std::string::npos && bracket > 0 && word.back() == ']'){
+        std::string count = word.substr(bracket + 1, word.size() - bracket - 2);
+        token.integer = std::strtoll(count.c_str(), &end, 10);
+        if(count.empty() || *end != '\0'){
+            throw MLBridgeException("Mock script line " + std::to_string(lineNumber) + ": bad argument count in " + word);
+        }
+        token.kind = MockToken::Function;
+        token.text = word.substr(0, bracket);
+        return token;
+    }
+    //Anything else is a symbol.
+    token.kind = MockToken::Symbol;
+    token.text = word;
+    return token;
+}
+
+//Splits a line into tokens. The first element is the packet name.
+static std::vector<MockToken> TokenizeLine(const std::string &line, int lineNumber){
+    std::vector<MockToken> tokens;
+    size_t i = 0;
+
+    while(i < line.size()){
+        char c = line[i];
+        if(std::isspace((unsigned char)c)){
+            i++;
+        } else if(c == '#'){
+            break;
+        } else if(c == '"'){
+            MockToken token;
+            token.kind = MockToken::String;
+            for(i++; i < line.size() && line[i] != '"'; i++){
+                if(line[i] == '\\' && i + 1 < line.size()){
+                    i++;
+                    switch(line[i]){
+                        case 'n': token.text.push_back('\n'); break;
+                        case 't': token.text.push_back('\t'); break;
+                        default: token.text.push_back(line[i]);
+                    }
+                } else{
+                    token.text.push_back(line[i]);
+                }
+            }
+            if(i >= line.size()){
+                throw MLBridgeException("Mock script line " + std::to_string(lineNumber) + ": unterminated string.");
+            }
+            i++;
+            tokens.push_back(token);
+        } else{
+            size_t start = i;
+            while(i < line.size() && !std::isspace((unsigned char)line[i]) && line[i] != '"' && line[i] != '#') i++;
+            tokens.push_back(ParseWord(line.substr(start, i - start), lineNumber));
+        }
+    }
+    return tokens;
+}
+
+MockScript MockScript::Parse(std::istream &in){
+    MockScript script;
+    std::string line;
+    int lineNumber = 0;
+    std::vector<MockPacket> *packets = &script.startup;
+
+    while(std::getline(in, line)){
+        lineNumber++;
+        std::vector<MockToken> tokens = TokenizeLine(line, lineNumber);
+        if(tokens.empty()) continue;
+
+        const MockToken &first = tokens.front();
+        if(first.kind == MockToken::Symbol && first.text == "---"){
+            //Start the reply to the next request.
+            MockExchange exchange;
+            if(tokens.size() > 1 && tokens[1].kind == MockToken::Integer){
+                exchange.delayMilliseconds = (int)tokens[1].integer;
+            }
+            script.exchanges.push_back(exchange);
+            packets = &script.exchanges.back().packets;
+            continue;
+        }
+        if(first.kind == MockToken::Symbol && first.text == "startup"){
+            if(tokens.size() < 2 || tokens[1].kind != MockToken::Integer){
+                throw MLBridgeException("Mock script line " + std::to_string(lineNumber) + ": startup needs a delay in milliseconds.");
+            }
+            script.startupDelayMilliseconds = (int)tokens[1].integer;
+            continue;
+        }
+        if(first.kind == MockToken::Symbol && first.text == "loop"){
+            script.loopFrom = (int)script.exchanges.size();
+            continue;
+        }
+
+        //A packet line.
+        MockPacket packet;
+        if(first.kind == MockToken::Integer){
+            packet.type = (int)first.integer;
+        } else{
+            bool found = false;
+            for(const auto &entry : packetNames){
+                if(first.text == entry.name){
+                    packet.type = entry.type;
+                    found = true;
+                    break;
+                }
+            }
+            if(!found){
+                throw MLBridgeException("Mock script line " + std::to_string(lineNumber) + ": unknown packet " + first.text);
+            }
+        }
+        packet.tokens.assign(tokens.begin() + 1, tokens.end());
+        packets->push_back(packet);
+    }
+    return script;
+}
+
+MockScript MockScript::Load(const std::string &path){
+    std::ifstream in(path);
+    if(!in){
+        throw MLBridgeException("Cannot open mock script " + path + ".");
+    }
+    return Parse(in);
+}
+
+
+/*
+ Wire format. Both ends of the socketpair live in this process, so we use native byte order.
+ */
+
+static void AppendBytes(std::string &buffer, const void *data, size_t size){
+    buffer.append((const char *)data, size);
+}
+
+void WriteMockPacket(int fd, const MockPacket &packet){
+    std::string buffer;
+    int32_t type = packet.type;
+    uint32_t count = (uint32_t)packet.tokens.size();
+
+    AppendBytes(buffer, &type, sizeof type);
+    AppendBytes(buffer, &count, sizeof count);
+    for(const auto &token : packet.tokens){
+        uint8_t kind = (uint8_t)token.kind;
+        int64_t integer = token.integer;
+        uint32_t length = (uint32_t)token.text.size();
+        AppendBytes(buffer, &kind, sizeof kind);
+        AppendBytes(buffer, &integer, sizeof integer);
+        AppendBytes(buffer, &token.real, sizeof token.real);
+        AppendBytes(buffer, &length, sizeof length);
+        buffer.append(token.text);
+        uint32_t depth = (uint32_t)token.dimensions.size();
+        AppendBytes(buffer, &depth, sizeof depth);
+        if(depth > 0) AppendBytes(buffer, token.dimensions.data(), depth * sizeof(int));
+    }
+
+    size_t written = 0;
+    while(written < buffer.size()){
+        //MSG_NOSIGNAL: a hung up peer is reported as an error, not SIGPIPE.
+        ssize_t n = send(fd, buffer.data() + written, buffer.size() - written, MSG_NOSIGNAL);
+        if(n <= 0) return;
+        written += (size_t)n;
+    }
+}
+
+static bool ReadBytes(int fd, void *data, size_t size){
+    size_t done = 0;
+    while(done < size){
+        ssize_t n = read(fd, (char *)data + done, size - done);
+        if(n <= 0) return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+bool ReadMockPacket(int fd, MockPacket &packet){
+    int32_t type;
+    uint32_t count;
+
+    if(!ReadBytes(fd, &type, sizeof type) || !ReadBytes(fd, &count, sizeof count)) return false;
+    packet.type = type;
+    packet.tokens.resize(count);
+    for(auto &token : packet.tokens){
+        uint8_t kind;
+        int64_t integer;
+        uint32_t length;
+        uint32_t depth;
+        if(!ReadBytes(fd, &kind, sizeof kind) || !ReadBytes(fd, &integer, sizeof integer)
+           || !ReadBytes(fd, &token.real, sizeof token.real) || !ReadBytes(fd, &length, sizeof length)){
+            return false;
+        }
+        token.kind = (MockToken::Kind)kind;
+        token.integer = integer;
+        token.text.resize(length);
+        if(length > 0 && !ReadBytes(fd, &token.text[0], length)) return false;
+        if(!ReadBytes(fd, &depth, sizeof depth)) return false;
+        token.dimensions.resize(depth);
+        if(depth > 0 && !ReadBytes(fd, token.dimensions.data(), depth * sizeof(int))) return false;
+    }
+    return true;
+}
+
+
+/*
+ MockKernel
+ */
+
+MockKernel::MockKernel(MockScript newScript): script(std::move(newScript)){
+    //Pass.
+}
+
+const MockExchange *MockKernel::Respond(const MockPacket &request){
+    {
+        std::lock_guard<std::mutex> lock(requestsMutex);
+        requests.push_back(request);
+    }
+
+    if(next >= script.exchanges.size()){
+        if(script.loopFrom < 0 || (size_t)script.loopFrom >= script.exchanges.size()) return nullptr;
+        next = (size_t)script.loopFrom;
+    }
+    return &script.exchanges[next++];
+}
+
+std::vector<MockPacket> MockKernel::Requests(){
+    std::lock_guard<std::mutex> lock(requestsMutex);
+    return requests;
+}
+
+void MockKernel::ForgetRequests(){
+    std::lock_guard<std::mutex> lock(requestsMutex);
+    requests.clear();
+}
+
+void MockKernel::Serve(int fd){
+    MockPacket request;
+
+    if(script.startupDelayMilliseconds > 0){
+        std::this_thread::sleep_for(std::chrono::milliseconds(script.startupDelayMilliseconds));
+    }
+    for(const auto &packet : script.startup) WriteMockPacket(fd, packet);
+
+    while(ReadMockPacket(fd, request)){
+        const MockExchange *exchange = Respond(request);
+        //Hanging up is how a dead kernel looks from the other end of the link.
+        if(exchange == nullptr) break;
+        if(exchange->delayMilliseconds > 0){
+            std::this_thread::sleep_for(std::chrono::milliseconds(exchange->delayMilliseconds));
+        }
+        for(const auto &packet : exchange->packets) WriteMockPacket(fd, packet);
+    }
+    close(fd);
+}
+
+
+/*
+ MockLink
+ */
+
+MockLink::MockLink(MockScript script, Transport newTransport):
+    kernel(std::move(script)),
+    transport(newTransport){
+    //Pass.
+}
+
+MockLink::~MockLink(){
+    Close();
+}
+
+int MockLink::Open(int, const char *[]){
+    open = true;
+    error = MMAEOK;
+
+    if(transport == InProcess){
+        MockExchange startup;
+        startup.delayMilliseconds = kernel.StartupDelay();
+        startup.packets = kernel.Startup();
+        Deliver(startup);
+        return MMAEOK;
+    }
+
+    int sockets[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0){
+        open = false;
+        return MMAEDEAD;
+    }
+    fd = sockets[0];
+    kernelThread = std::thread(&MockKernel::Serve, &kernel, sockets[1]);
+    return MMAEOK;
+}
+
+int MockLink::Activate(){
+    return open ? 1 : 0;
+}
+
+void MockLink::Close(){
+    if(fd >= 0){
+        shutdown(fd, SHUT_RDWR);
+        close(fd);
+        fd = -1;
+    }
+    if(kernelThread.joinable()) kernelThread.join();
+    open = false;
+}
+
+void MockLink::Fail(const std::string &message){
+    error = MMAEDEAD;
+    errorMessage = message;
+}
+
+void MockLink::Deliver(const MockExchange &exchange){
+    Clock::time_point readyAt = Clock::now() + std::chrono::milliseconds(exchange.delayMilliseconds);
+    for(const auto &packet : exchange.packets){
+        incoming.emplace_back(readyAt, packet);
+    }
+}
+
+bool MockLink::Receive(bool block){
+    MockPacket packet;
+    pollfd pfd{fd, POLLIN, 0};
+
+    while(fd >= 0 && (block || poll(&pfd, 1, 0) > 0)){
+        if(!ReadMockPacket(fd, packet)){
+            Fail("The mock kernel hung up.");
+            return false;
+        }
+        incoming.emplace_back(Clock::time_point(), packet);
+        block = false;
+    }
+    return !incoming.empty();
+}
+
+ILink::WaitResult MockLink::WaitForLinkActivity(AbortCallback abort){
+    while(true){
+        if(Ready()) return WaitSuccess;
+        if(error != MMAEOK) return WaitError;
+        if(abort && abort()) return WaitAborted;
+
+        if(transport == InProcess){
+            if(incoming.empty()){
+                //Nothing is coming, ever.
+                Fail("The mock kernel script is exhausted.");
+                return WaitError;
+            }
+            auto wait = incoming.front().first - Clock::now();
+            std::this_thread::sleep_for(std::min<Clock::duration>(wait, std::chrono::milliseconds(pollMilliseconds)));
+        } else{
+            pollfd pfd{fd, POLLIN, 0};
+            poll(&pfd, 1, pollMilliseconds);
+        }
+    }
+}
+
+int MockLink::Ready(){
+    if(currentToken < current.tokens.size()) return 1;
+    if(transport == SocketPair) Receive(false);
+    return !incoming.empty() && incoming.front().first <= Clock::now();
+}
+
+int MockLink::NewPacket(){
+    current = MockPacket();
+    currentToken = 0;
+    currentOffset = 0;
+    pendingHead = nullptr;
+    return 1;
+}
+
+int MockLink::NextPacket(){
+    if(incoming.empty() && transport == SocketPair) Receive(true);
+    if(incoming.empty()){
+        if(error == MMAEOK) Fail("The mock kernel script is exhausted.");
+        return ILLEGALPKT;
+    }
+
+    //Block until the reply is "computed," just like the real thing.
+    std::this_thread::sleep_until(incoming.front().first);
+    current = std::move(incoming.front().second);
+    incoming.pop_front();
+    currentToken = 0;
+    currentOffset = 0;
+    pendingHead = nullptr;
+    return current.type;
+}
+
+bool MockLink::FitsIn64Bits(const MockToken &token){
+    long long integer;
+    if(token.text.empty() || std::from_chars(token.text.data(), token.text.data() + token.text.size(), integer).ec == std::errc()) return true;
+    Fail("The mock kernel sent an integer that does not fit in 64 bits.");
+    return false;
+}
+
+const MockToken *MockLink::NextToken(MockToken::Kind kind){
+    if(currentToken >= current.tokens.size() || current.tokens[currentToken].kind != kind){
+        Fail("The mock kernel sent data of an unexpected type.");
+        return nullptr;
+    }
+    return &current.tokens[currentToken++];
+}
+
+int MockLink::GetUTF8String(const unsigned char **string, int *bytes, int *characters){
+    //Like the real thing, we'll read an integer as its digits.
+    bool digits = currentToken < current.tokens.size() && current.tokens[currentToken].kind == MockToken::Integer && !current.tokens[currentToken].text.empty();
+    const MockToken *token = NextToken(digits ? MockToken::Integer : MockToken::String);
+    if(token == nullptr) return 0;
+    *string = (const unsigned char *)token->text.data();
+    *bytes = (int)token->text.size();
+    //We don't count code points; nothing in MLBridge uses this.
+    *characters = *bytes;
+    return 1;
+}
+
+int MockLink::GetUTF8Symbol(const unsigned char **string, int *bytes, int *characters){
+    //Script functions are written head[n], so their head is always a symbol.
+    const MockToken *token = pendingHead ? pendingHead : NextToken(MockToken::Symbol);
+    pendingHead = nullptr;
+    if(token == nullptr) return 0;
+    *string = (const unsigned char *)token->text.data();
+    *bytes = (int)token->text.size();
+    *characters = *bytes;
+    return 1;
+}
+
+void MockLink::ReleaseUTF8String(const unsigned char *, int){
+    //The buffer belongs to the current packet.
+}
+
+int MockLink::GetUTF8Characters(int *remaining, unsigned char *buffer, int capacity, int *bytes, int *characters){
+    if(currentToken >= current.tokens.size() || current.tokens[currentToken].kind != MockToken::String || capacity <= 0){
+        Fail("The mock kernel sent data of an unexpected type.");
+        return 0;
+    }
+
+    const std::string &text = current.tokens[currentToken].text;
+    size_t count = std::min(text.size() - currentOffset, (size_t)capacity);
+    std::memcpy(buffer, text.data() + currentOffset, count);
+    currentOffset += count;
+    *bytes = (int)count;
+    *characters = *bytes;
+    *remaining = (int)(text.size() - currentOffset);
+
+    //The whole string has been read, so move on to the next token.
+    if(*remaining == 0){
+        currentToken++;
+        currentOffset = 0;
+    }
+    return 1;
+}
+
+int MockLink::GetInteger(int *integer){
+    const MockToken *token = NextToken(MockToken::Integer);
+    if(token == nullptr || !FitsIn64Bits(*token)) return 0;
+    *integer = (int)token->integer;
+    return 1;
+}
+
+int MockLink::GetNext(){
+    if(pendingHead) return MMATKSYM;
+    if(currentToken >= current.tokens.size()) return MMATKERR;
+    switch(current.tokens[currentToken].kind){
+        case MockToken::String: return MMATKSTR;
+        case MockToken::Symbol: return MMATKSYM;
+        case MockToken::Integer: return MMATKINT;
+        case MockToken::Real: return MMATKREAL;
+        case MockToken::Function: return MMATKFUNC;
+        //A packed array looks like any other function until it is read.
+        case MockToken::Array: return MMATKFUNC;
+    }
+    return MMATKERR;
+}
+
+int MockLink::GetArgCount(int *count){
+    const MockToken *token = NextToken(MockToken::Function);
+    if(token == nullptr) return 0;
+    *count = (int)token->integer;
+    pendingHead = token;
+    return 1;
+}
+
+int MockLink::GetInteger64(long long *integer){
+    const MockToken *token = NextToken(MockToken::Integer);
+    if(token == nullptr || !FitsIn64Bits(*token)) return 0;
+    *integer = token->integer;
+    return 1;
+}
+
+int MockLink::GetReal64(double *real){
+    //Like the real thing, we'll read an integer as a real.
+    if(currentToken < current.tokens.size() && current.tokens[currentToken].kind == MockToken::Integer){
+        *real = (double)current.tokens[currentToken++].integer;
+        return 1;
+    }
+    const MockToken *token = NextToken(MockToken::Real);
+    if(token == nullptr) return 0;
+    *real = token->real;
+    return 1;
+}
+
+//The link's element type for T.
+static int ArrayElementType(double *){ return MMATKREAL; }
+static int ArrayElementType(long long *){ return MMATKINT; }
+
+template<typename T> bool MockLink::ReadArrayLevel(std::vector<T> &elements, size_t level){
+    if(currentToken >= current.tokens.size()) return false;
+    const MockToken &token = current.tokens[currentToken++];
+
+    if(level == arrayDimensions.size()){
+        //An element. Integers can be read as reals, but not the other way around.
+        if(token.kind == MockToken::Integer){
+            elements.push_back((T)token.integer);
+            return true;
+        }
+        if(token.kind == MockToken::Real && ArrayElementType((T *)nullptr) == MMATKREAL){
+            elements.push_back((T)token.real);
+            return true;
+        }
+        return false;
+    }
+
+    //Every sublist at a level must be the same length.
+    if(token.kind != MockToken::Function || token.text != "List" || token.integer != arrayDimensions[level]) return false;
+    for(int i = 0; i < arrayDimensions[level]; i++){
+        if(!ReadArrayLevel(elements, level + 1)) return false;
+    }
+    return true;
+}
+
+template<typename T> int MockLink::GetArrayAs(std::vector<T> &elements, T **data, int **dimensions, char ***heads, int *depth){
+    static char list[] = "List";
+
+    if(currentToken >= current.tokens.size()){
+        Fail("The mock kernel sent data of an unexpected type.");
+        return 0;
+    }
+    elements.clear();
+    arrayDimensions.clear();
+
+    const MockToken &first = current.tokens[currentToken];
+    if(first.kind == MockToken::Array && first.integer == ArrayElementType((T *)nullptr)){
+        currentToken++;
+        elements.resize(first.text.size() / sizeof(T));
+        std::memcpy(elements.data(), first.text.data(), elements.size() * sizeof(T));
+        arrayDimensions = first.dimensions;
+    } else{
+        //The dimensions are the lengths of the first list at each level.
+        for(size_t i = currentToken; i < current.tokens.size(); i++){
+            const MockToken &token = current.tokens[i];
+            if(token.kind != MockToken::Function || token.text != "List") break;
+            arrayDimensions.push_back((int)token.integer);
+            if(token.integer == 0) break;
+        }
+        if(arrayDimensions.empty() || !ReadArrayLevel(elements, 0)){
+            Fail("The mock kernel sent something other than a rectangular array of numbers.");
+            return 0;
+        }
+    }
+
+    arrayHeads.assign(arrayDimensions.size(), list);
+    *data = elements.data();
+    *dimensions = arrayDimensions.data();
+    *heads = arrayHeads.data();
+    *depth = (int)arrayDimensions.size();
+    return 1;
+}
+
+int MockLink::GetArray(double **data, int **dimensions, char ***heads, int *depth){
+    return GetArrayAs(realArray, data, dimensions, heads, depth);
+}
+
+int MockLink::GetArray(long long **data, int **dimensions, char ***heads, int *depth){
+    return GetArrayAs(integerArray, data, dimensions, heads, depth);
+}
+
+void MockLink::ReleaseArray(double *, int *, char **, int){
+    //The array belongs to the link until the next GetArray.
+}
+
+void MockLink::ReleaseArray(long long *, int *, char **, int){
+    //The array belongs to the link until the next GetArray.
+}
+
+int MockLink::PutFunction(const char *head, int argCount){
+    if(outgoing.tokens.empty()){
+        for(const auto &entry : requestHeads){
+            if(std::strcmp(head, entry.head) == 0) outgoing.type = entry.type;
+        }
+    }
+    MockToken token;
+    token.kind = MockToken::Function;
+    token.text = head;
+    token.integer = argCount;
+    outgoing.tokens.push_back(token);
+    return 1;
+}
+
+int MockLink::PutUTF8String(const unsigned char *string, int bytes){
+    MockToken token;
+    token.kind = MockToken::String;
+    token.text.assign((const char *)string, (size_t)bytes);
+    outgoing.tokens.push_back(token);
+    return 1;
+}
+
+int MockLink::PutSymbol(const char *symbol){
+    MockToken token;
+    token.kind = MockToken::Symbol;
+    token.text = symbol;
+    outgoing.tokens.push_back(token);
+    return 1;
+}
+
+//The kernel keeps every request, so an array is recorded as one token holding a copy of its elements rather than a token per element.
+static MockToken MakeArrayToken(int elementType, const void *data, size_t elementSize, const int *dimensions, int depth){
+    MockToken token;
+    size_t count = 1;
+
+    token.kind = MockToken::Array;
+    token.integer = elementType;
+    token.dimensions.assign(dimensions, dimensions + depth);
+    for(int dimension : token.dimensions) count *= (size_t)dimension;
+    token.text.assign((const char *)data, count * elementSize);
+    return token;
+}
+
+int MockLink::PutArray(const double *data, const int *dimensions, int depth){
+    outgoing.tokens.push_back(MakeArrayToken(MMATKREAL, data, sizeof *data, dimensions, depth));
+    return 1;
+}
+
+int MockLink::PutArray(const long long *data, const int *dimensions, int depth){
+    outgoing.tokens.push_back(MakeArrayToken(MMATKINT, data, sizeof *data, dimensions, depth));
+    return 1;
+}
+
+int MockLink::EndPacket(){
+    if(!open){
+        Fail("The mock link is not open.");
+        return 0;
+    }
+
+    if(transport == InProcess){
+        const MockExchange *exchange = kernel.Respond(outgoing);
+        if(exchange) Deliver(*exchange);
+    } else{
+        WriteMockPacket(fd, outgoing);
+    }
+    outgoing = MockPacket();
+    return 1;
+}
+
+int MockLink::Flush(){
+    return open ? 1 : 0;
+}
+
+int MockLink::PutInterruptMessage(){
+    interrupts++;
+    return 1;
+}
+
+int MockLink::Error(){
+    return error;
+}
+
+std::string MockLink::ErrorMessage(){
+    return errorMessage;
+}
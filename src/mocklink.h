@@ -0,0 +1,197 @@
+//
+//  mocklink.h
+//  MathLinkBridge
+//
+//  A scriptable stand-in for the Mathematica kernel. A MockScript is a
+//  recorded kernel session: the packets the kernel sends on startup, then
+//  one reply (a list of packets) for every packet MLBridge sends. MockLink
+//  plays the script back through the ILink interface, either in-process or
+//  from a kernel thread on the other end of a local socketpair, so that the
+//  packet loop can be profiled and regression tested without a license.
+//
+//  Script files are plain text:
+//
+//      # Everything after a '#' is a comment.
+//      INPUTNAMEPKT "In[1]:= "         <- sent on startup
+//      ---                             <- reply to the first request
+//      RETURNPKT "Null"
+//      --- 30000                       <- reply delayed by 30000 ms
+//      OUTPUTNAMEPKT "Out[1]= "
+//      RETURNTEXTPKT "2"
+//      MESSAGEPKT Syntax "sntxi"       <- bare words are symbols
+//      SYNTAXPKT 4                     <- integers and reals are numbers
+//      RETURNPKT List[2] 1.5 f[1] x    <- head[n] starts a function of n arguments
+//      INPUTNAMEPKT "In[2]:= "
+//
+//  A line "startup 5000" anywhere in the script holds back the startup packets
+//  for 5000 ms, like a kernel that is slow to launch.
+//
+//  A line containing only "loop" marks where the kernel starts over once the
+//  script is exhausted: the next reply after it is replayed again, and so on.
+//  Put it after the replies to MLBridge's setup requests to load test the
+//  packet loop indefinitely.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <istream>
+
+#include "link.h"
+
+//One element of a packet.
+struct MockToken{
+    enum Kind {String, Symbol, Integer, Real, Function, Array};
+    Kind kind = String;
+    //The string, symbol or function head. The digits of an Integer read from a script. The raw elements of an Array.
+    std::string text;
+    //The value of an Integer, the argument count of a Function, or the element type of an Array (MMATKREAL or MMATKINT).
+    long long integer = 0;
+    double real = 0;
+    //The dimensions of an Array.
+    std::vector<int> dimensions;
+};
+
+struct MockPacket{
+    int type = ILLEGALPKT;
+    std::vector<MockToken> tokens;
+};
+
+//The kernel's reply to a single request.
+struct MockExchange{
+    int delayMilliseconds = 0;
+    std::vector<MockPacket> packets;
+};
+
+struct MockScript{
+    std::vector<MockPacket> startup;
+    std::vector<MockExchange> exchanges;
+    //The exchange to start over from once the script is exhausted, or -1 to stop.
+    int loopFrom = -1;
+    //How long the kernel takes to send the startup packets.
+    int startupDelayMilliseconds = 0;
+
+    //Throws MLBridgeException on malformed input.
+    static MockScript Parse(std::istream &in);
+    static MockScript Load(const std::string &path);
+};
+
+//Plays the kernel's side of a MockScript. Keeps a record of every request it has seen.
+class MockKernel{
+public:
+    explicit MockKernel(MockScript script);
+
+    //Returns the reply to the next request, or nullptr if the script is exhausted.
+    const MockExchange *Respond(const MockPacket &request);
+    const std::vector<MockPacket> &Startup() const { return script.startup; }
+    int StartupDelay() const { return script.startupDelayMilliseconds; }
+
+    std::vector<MockPacket> Requests();
+    //Empties the record of requests, so that a long run doesn't grow it without bound.
+    void ForgetRequests();
+    //Serves the script over a socket until the other end hangs up.
+    void Serve(int fd);
+
+private:
+    MockScript script;
+    size_t next = 0;
+    std::mutex requestsMutex;
+    std::vector<MockPacket> requests;
+};
+
+class MockLink: public ILink {
+public:
+    enum Transport {InProcess, SocketPair};
+
+    MockLink(MockScript script, Transport transport = InProcess);
+    ~MockLink() override;
+
+    MockKernel &Kernel(){ return kernel; }
+    //The number of interrupt messages MLBridge has sent.
+    int Interrupts() const { return interrupts; }
+
+    int Open(int argc, const char *argv[]) override;
+    int Activate() override;
+    void Close() override;
+
+    WaitResult WaitForLinkActivity(AbortCallback abort = nullptr) override;
+    int Ready() override;
+    int NextPacket() override;
+    int NewPacket() override;
+    int GetUTF8String(const unsigned char **string, int *bytes, int *characters) override;
+    int GetUTF8Symbol(const unsigned char **string, int *bytes, int *characters) override;
+    void ReleaseUTF8String(const unsigned char *string, int bytes) override;
+    int GetUTF8Characters(int *remaining, unsigned char *buffer, int capacity, int *bytes, int *characters) override;
+    int GetInteger(int *integer) override;
+    int GetNext() override;
+    int GetArgCount(int *count) override;
+    int GetInteger64(long long *integer) override;
+    int GetReal64(double *real) override;
+    int GetArray(double **data, int **dimensions, char ***heads, int *depth) override;
+    int GetArray(long long **data, int **dimensions, char ***heads, int *depth) override;
+    void ReleaseArray(double *data, int *dimensions, char **heads, int depth) override;
+    void ReleaseArray(long long *data, int *dimensions, char **heads, int depth) override;
+
+    int PutFunction(const char *head, int argCount) override;
+    int PutUTF8String(const unsigned char *string, int bytes) override;
+    int PutSymbol(const char *symbol) override;
+    int PutArray(const double *data, const int *dimensions, int depth) override;
+    int PutArray(const long long *data, const int *dimensions, int depth) override;
+    int EndPacket() override;
+    int Flush() override;
+    int PutInterruptMessage() override;
+
+    int Error() override;
+    std::string ErrorMessage() override;
+
+protected:
+    //Returns the next token of the current packet if it has the given kind, otherwise flags an error.
+    const MockToken *NextToken(MockToken::Kind kind);
+    //Whether an Integer token fits in a long long, flagging an error if it doesn't, as the real thing does.
+    bool FitsIn64Bits(const MockToken &token);
+    void Fail(const std::string &message);
+    //Reads an Array token, or nested List[n] tokens of numbers as a script would write a matrix, into elements.
+    template<typename T> int GetArrayAs(std::vector<T> &elements, T **data, int **dimensions, char ***heads, int *depth);
+    template<typename T> bool ReadArrayLevel(std::vector<T> &elements, size_t level);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    MockKernel kernel;
+    Transport transport;
+    bool open = false;
+    int error = MMAEOK;
+    std::string errorMessage;
+    int interrupts = 0;
+
+    //Packets the kernel has sent that we haven't read yet. In-process replies carry the time they become readable.
+    std::deque<std::pair<Clock::time_point, MockPacket>> incoming;
+    MockPacket current;
+    size_t currentToken = 0;
+    //How much of the current string token GetUTF8Characters has handed out.
+    size_t currentOffset = 0;
+    //The head of the function token GetArgCount just read, which is next to be read as a symbol.
+    const MockToken *pendingHead = nullptr;
+    //The array GetArray handed out last. Like the strings, it belongs to the link.
+    std::vector<double> realArray;
+    std::vector<long long> integerArray;
+    std::vector<int> arrayDimensions;
+    std::vector<char *> arrayHeads;
+    MockPacket outgoing;
+
+    int fd = -1;
+    std::thread kernelThread;
+
+    void Deliver(const MockExchange &exchange);
+    //Reads whatever the kernel thread has written. If block is true, waits until at least one packet has arrived.
+    bool Receive(bool block);
+};
+
+//Wire format used between MockLink and the kernel thread.
+void WriteMockPacket(int fd, const MockPacket &packet);
+bool ReadMockPacket(int fd, MockPacket &packet);
@@ -0,0 +1,158 @@
+//
+//  packetstats.cpp
+//  MathLinkBridge
+//
+
+#include <csignal>
+#include <cerrno>
+#include <algorithm>
+
+#include <unistd.h>
+
+#include "config.h"
+#include "packetstats.h"
+
+//Indexed by packet type.
+static const char *const packetNames[PacketStatistics::packetTypes] = {
+    "ILLEGALPKT", "INPUTPKT", "TEXTPKT", "RETURNPKT", "RETURNTEXTPKT", "MESSAGEPKT", "MENUPKT", "CALLPKT",
+    "INPUTNAMEPKT", "OUTPUTNAMEPKT", "SYNTAXPKT", "DISPLAYPKT", "DISPLAYENDPKT", "EVALUATEPKT", "ENTERTEXTPKT", "ENTEREXPRPKT",
+    "RETURNEXPRPKT", "SUSPENDPKT", "RESUMEPKT", "BEGINDLGPKT", "ENDDLGPKT", "INPUTSTRPKT", "PKT22", "OTHERPKT"
+};
+
+PacketStatistics::PacketStatistics(){
+    Reset();
+}
+
+void PacketStatistics::Reset(){
+    for(Counters &counters : packets){
+        counters.count = 0;
+        counters.bytes = 0;
+        counters.waitNanoseconds = 0;
+        counters.handlingNanoseconds = 0;
+        for(int i = 0; i < buckets; i++){
+            counters.waitHistogram[i] = 0;
+            counters.handlingHistogram[i] = 0;
+        }
+    }
+}
+
+const char *PacketStatistics::PacketName(int packet){
+    return packetNames[Slot(packet)];
+}
+
+int PacketStatistics::Slot(int packet){
+    if(packet < 0 || packet >= packetTypes) return packetTypes - 1;
+    return packet;
+}
+
+int PacketStatistics::Bucket(std::chrono::nanoseconds duration){
+    uint64_t microseconds = (uint64_t)std::max<int64_t>(duration.count(), 0) / 1000;
+    int bucket = 0;
+
+    while(microseconds > 1 && bucket < buckets - 1){
+        microseconds >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void PacketStatistics::RecordWait(int packet, std::chrono::nanoseconds wait){
+    Counters &counters = packets[Slot(packet)];
+
+    counters.count.fetch_add(1, std::memory_order_relaxed);
+    counters.waitNanoseconds.fetch_add((uint64_t)std::max<int64_t>(wait.count(), 0), std::memory_order_relaxed);
+    counters.waitHistogram[Bucket(wait)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void PacketStatistics::RecordHandling(int packet, std::chrono::nanoseconds handling, uint64_t bytes){
+    Counters &counters = packets[Slot(packet)];
+
+    counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    counters.handlingNanoseconds.fetch_add((uint64_t)std::max<int64_t>(handling.count(), 0), std::memory_order_relaxed);
+    counters.handlingHistogram[Bucket(handling)].fetch_add(1, std::memory_order_relaxed);
+}
+
+//Formats a line at a time without allocating, so that WriteTo() is safe in a signal handler.
+class SignalSafeWriter{
+public:
+    explicit SignalSafeWriter(int fd): fd(fd) {}
+    ~SignalSafeWriter(){ Flush(); }
+
+    void Put(const char *text){
+        while(*text) Put(*text++);
+    }
+    void Put(char c){
+        if(size == sizeof buffer) Flush();
+        buffer[size++] = c;
+    }
+    void Put(uint64_t value){
+        char digits[20];
+        int n = 0;
+        do {
+            digits[n++] = (char)('0' + value % 10);
+            value /= 10;
+        } while(value > 0);
+        while(n > 0) Put(digits[--n]);
+    }
+    void Flush(){
+        size_t written = 0;
+        while(written < size){
+            ssize_t n = write(fd, buffer + written, size - written);
+            if(n <= 0) break;
+            written += (size_t)n;
+        }
+        size = 0;
+    }
+
+private:
+    int fd;
+    char buffer[4096];
+    size_t size = 0;
+};
+
+void PacketStatistics::WriteTo(int fd) const{
+    SignalSafeWriter out(fd);
+
+    out.Put("packet\tcount\tbytes\twait_ns\thandling_ns\twait_histogram_us\thandling_histogram_us\n");
+    for(int slot = 0; slot < packetTypes; slot++){
+        const Counters &counters = packets[slot];
+        uint64_t count = counters.count.load(std::memory_order_relaxed);
+        if(count == 0) continue;
+
+        out.Put(packetNames[slot]);
+        out.Put('\t');
+        out.Put(count);
+        out.Put('\t');
+        out.Put((uint64_t)counters.bytes.load(std::memory_order_relaxed));
+        out.Put('\t');
+        out.Put((uint64_t)counters.waitNanoseconds.load(std::memory_order_relaxed));
+        out.Put('\t');
+        out.Put((uint64_t)counters.handlingNanoseconds.load(std::memory_order_relaxed));
+        for(const std::atomic<uint64_t> *histogram : {counters.waitHistogram, counters.handlingHistogram}){
+            out.Put('\t');
+            for(int i = 0; i < buckets; i++){
+                if(i > 0) out.Put(',');
+                out.Put((uint64_t)histogram[i].load(std::memory_order_relaxed));
+            }
+        }
+        out.Put('\n');
+    }
+    out.Put('\n');
+}
+
+//What DumpOnSignal installed. Plain pointers and an int are all a signal handler can safely use.
+static PacketStatistics *volatile signalStatistics = nullptr;
+static volatile int signalFd = -1;
+
+static void DumpHandler(int){
+    int savedErrno = errno;
+    PacketStatistics *statistics = signalStatistics;
+    if(statistics) statistics->WriteTo(signalFd);
+    errno = savedErrno;
+}
+
+void PacketStatistics::DumpOnSignal(PacketStatistics *statistics, int fd, int signal){
+    signalStatistics = statistics;
+    signalFd = fd;
+    std::signal(signal, DumpHandler);
+}
@@ -0,0 +1,63 @@
+//
+//  packetstats.h
+//  MathLinkBridge
+//
+//  Counts the packets MLBridge receives, by packet type, and how long each
+//  one took: the time spent waiting for it (the kernel computing, plus the
+//  link delivering it) and the time MathLine spent handling it once it was
+//  there. Durations go into histograms with power of two buckets, in
+//  microseconds, so that a few slow packets stand out from many fast ones.
+//
+//  Everything is a relaxed atomic counter. Recording never locks, and the
+//  statistics can be written out from a signal handler.
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+class PacketStatistics{
+public:
+    //Packet types at or above this share the last slot.
+    static const int packetTypes = 24;
+    //Bucket 0 is under 2 µs. Bucket i is [2^i, 2^(i+1)) µs. The last bucket takes everything longer.
+    static const int buckets = 32;
+
+    PacketStatistics();
+    PacketStatistics(const PacketStatistics &) = delete;
+    PacketStatistics &operator=(const PacketStatistics &) = delete;
+
+    //A packet of the given type arrived after waiting this long. Every packet is counted here.
+    void RecordWait(int packet, std::chrono::nanoseconds wait);
+    //Handling a packet of the given type took this long and read this many bytes of strings from the link.
+    void RecordHandling(int packet, std::chrono::nanoseconds handling, uint64_t bytes);
+    void Reset();
+
+    /*
+     Writes the statistics to the file descriptor fd as tab separated values: a header line, then one line per packet type received so far with its count, bytes, total wait and handling time in nanoseconds, and both histograms as comma separated bucket counts. Only uses write(2), so it is safe to call from a signal handler.
+     */
+    void WriteTo(int fd) const;
+
+    /*
+     Writes the statistics to fd whenever the process receives signal, e.g. SIGUSR1. One PacketStatistics per process can be dumped this way; installing another replaces the first.
+     */
+    static void DumpOnSignal(PacketStatistics *statistics, int fd, int signal);
+    //The name of a packet type, e.g. "RETURNPKT".
+    static const char *PacketName(int packet);
+
+private:
+    struct Counters{
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> bytes;
+        std::atomic<uint64_t> waitNanoseconds;
+        std::atomic<uint64_t> handlingNanoseconds;
+        std::atomic<uint64_t> waitHistogram[buckets];
+        std::atomic<uint64_t> handlingHistogram[buckets];
+    };
+    Counters packets[packetTypes];
+
+    static int Slot(int packet);
+    static int Bucket(std::chrono::nanoseconds duration);
+};
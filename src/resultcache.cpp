@@ -0,0 +1,303 @@
+//
+//  resultcache.cpp
+//  MathLinkBridge
+//
+
+#include <cctype>
+#include <cstdio>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <utility>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include "resultcache.h"
+
+//The files of the on-disk store are named by a hash of the key, and end with this.
+static const char *const resultExtension = ".result";
+
+ResultCache::ResultCache(std::string newDirectory, size_t newMaxEntries):
+    directory(std::move(newDirectory)),
+    maxEntries(newMaxEntries){
+    if(!directory.empty() && directory.back() != '/') directory.push_back('/');
+}
+
+void ResultCache::SetKernelVersion(std::string version){
+    kernelVersion = std::move(version);
+}
+
+std::string ResultCache::Normalize(std::string_view input){
+    std::string normalized;
+    int commentDepth = 0;
+    bool inString = false;
+    bool space = false;
+
+    normalized.reserve(input.size());
+    for(size_t i = 0; i < input.size(); i++){
+        char c = input[i];
+        char next = i + 1 < input.size() ? input[i + 1] : 0;
+
+        if(inString){
+            normalized.push_back(c);
+            if(c == '\\' && next){
+                normalized.push_back(next);
+                i++;
+            } else if(c == '"'){
+                inString = false;
+            }
+            continue;
+        }
+        if(c == '(' && next == '*'){
+            commentDepth++;
+            i++;
+            continue;
+        }
+        if(commentDepth > 0){
+            if(c == '*' && next == ')'){
+                commentDepth--;
+                i++;
+                //A comment separates what's on either side of it, like a space.
+                if(commentDepth == 0) space = true;
+            }
+            continue;
+        }
+        if(c == ' ' || c == '\t' || c == '\n' || c == '\r'){
+            space = true;
+            continue;
+        }
+
+        //A space matters between two operands, where it means multiplication, but not next to a bracket or a comma.
+        if(space && !normalized.empty()){
+            char previous = normalized.back();
+            bool afterOpen = previous == '[' || previous == '(' || previous == '{' || previous == ',';
+            bool beforeClose = c == ']' || c == ')' || c == '}' || c == ',';
+            if(!afterOpen && !beforeClose) normalized.push_back(' ');
+        }
+        space = false;
+        normalized.push_back(c);
+        if(c == '"') inString = true;
+    }
+    return normalized;
+}
+
+//Symbols whose use makes an input uncacheable, and the prefixes of more of them.
+static const char *const impureSymbols[] = {
+    "Now", "Today", "Tomorrow", "Yesterday", "AbsoluteTime", "SessionTime", "TimeUsed", "Timing", "AbsoluteTiming", "TimeConstrained", "Pause",
+    "Echo", "Message", "Needs", "Install", "Uninstall", "Close", "Unique", "Protect", "Unprotect", "Remove",
+    "Begin", "End", "BeginPackage", "EndPackage",
+    "Increment", "Decrement", "PreIncrement", "PreDecrement", "AppendTo", "PrependTo", "AddTo", "SubtractFrom", "TimesBy", "DivideBy", "ApplyTo",
+    "DeleteFile", "DeleteDirectory", "CopyFile", "CopyDirectory", "RenameFile", "RenameDirectory",
+};
+static const char *const impurePrefixes[] = {
+    "Set", "Unset", "Clear", "Random", "Seed", "Print", "Put", "Get", "Run", "Read", "Write", "Open", "Create", "Import", "Export", "Date", "URL",
+};
+
+static bool IsImpureSymbol(std::string_view symbol){
+    //Only the name counts, not the context: System`Print is Print.
+    size_t context = symbol.rfind('`');
+    if(context != std::string_view::npos) symbol.remove_prefix(context + 1);
+    //Session state, e.g. $Line or $SessionID.
+    if(symbol.empty() || symbol[0] == '$') return true;
+
+    for(const char *name : impureSymbols){
+        if(symbol == name) return true;
+    }
+    for(const char *prefix : impurePrefixes){
+        if(symbol.compare(0, std::char_traits<char>::length(prefix), prefix) == 0) return true;
+    }
+    return false;
+}
+
+bool ResultCache::IsCacheable(std::string_view input){
+    int commentDepth = 0;
+    bool inString = false;
+
+    for(size_t i = 0; i < input.size(); i++){
+        char c = input[i];
+        char next = i + 1 < input.size() ? input[i + 1] : 0;
+        char previous = i > 0 ? input[i - 1] : 0;
+
+        if(inString){
+            if(c == '\\' && next){
+                i++;
+            } else if(c == '"'){
+                inString = false;
+            }
+            continue;
+        }
+        if(c == '(' && next == '*'){
+            commentDepth++;
+            i++;
+            continue;
+        }
+        if(commentDepth > 0){
+            if(c == '*' && next == ')'){
+                commentDepth--;
+                i++;
+            }
+            continue;
+        }
+
+        switch(c){
+            case '"':
+                inString = true;
+                break;
+            case '=':
+                //== and ===, and =!=, compare.
+                if(next == '='){
+                    while(i + 1 < input.size() && input[i + 1] == '=') i++;
+                    break;
+                }
+                if(next == '!' && i + 2 < input.size() && input[i + 2] == '='){
+                    i += 2;
+                    break;
+                }
+                //So do !=, <= and >=. Anything else is some kind of assignment: =, :=, +=, ^:=, /: ... =, =. and so on.
+                if(previous == '!' || previous == '<' || previous == '>') break;
+                return false;
+            case '+':
+            case '-':
+                //++ and --.
+                if(next == c) return false;
+                break;
+            case '>':
+            case '<':
+                //>>, >>> and <<, that is, Put, PutAppend and Get.
+                if(next == c) return false;
+                break;
+            case '%':
+                //The results of earlier evaluations.
+                return false;
+            default:
+                if(std::isalpha((unsigned char)c) || c == '$'){
+                    size_t start = i;
+                    while(i + 1 < input.size() && (std::isalnum((unsigned char)input[i + 1]) || input[i + 1] == '$' || input[i + 1] == '`')) i++;
+                    if(IsImpureSymbol(input.substr(start, i - start + 1))) return false;
+                }
+                break;
+        }
+    }
+    return true;
+}
+
+std::string ResultCache::MakeKey(std::string_view input) const{
+    //The version can't contain a NUL, so the key is unambiguous.
+    std::string key = kernelVersion;
+    key.push_back('\0');
+    key.append(Normalize(input));
+    return key;
+}
+
+std::string ResultCache::PathFor(const std::string &key) const{
+    //64 bit FNV-1a. Collisions are caught by storing the key in the file.
+    uint64_t hash = 14695981039346656037ULL;
+    char name[17];
+
+    for(unsigned char c : key){
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    std::snprintf(name, sizeof name, "%016llx", (unsigned long long)hash);
+    return directory + name + resultExtension;
+}
+
+void ResultCache::Remember(const std::string &key, std::string_view result){
+    auto found = entries.find(key);
+    if(found != entries.end()){
+        found->second.result.assign(result.data(), result.size());
+        return;
+    }
+    if(maxEntries == 0) return;
+    while(entries.size() >= maxEntries && !order.empty()){
+        entries.erase(order.front());
+        order.pop_front();
+    }
+    order.push_back(key);
+    entries.emplace(key, Entry{std::string(result), std::prev(order.end())});
+}
+
+bool ResultCache::Lookup(std::string_view input, std::string &result){
+    std::string key = MakeKey(input);
+
+    auto found = entries.find(key);
+    if(found != entries.end()){
+        result = found->second.result;
+        counters.hits++;
+        return true;
+    }
+
+    if(!directory.empty()){
+        //The file holds the length of the key on a line of its own, the key, and then the result.
+        std::ifstream file(PathFor(key), std::ios::binary);
+        size_t keyLength = 0;
+        if(file >> keyLength && file.get() == '\n' && keyLength == key.size()){
+            std::string storedKey(keyLength, '\0');
+            if(file.read(&storedKey[0], (std::streamsize)keyLength) && storedKey == key){
+                std::ostringstream contents;
+                contents << file.rdbuf();
+                result = contents.str();
+                Remember(key, result);
+                counters.hits++;
+                return true;
+            }
+        }
+    }
+
+    counters.misses++;
+    return false;
+}
+
+void ResultCache::Store(std::string_view input, std::string_view result){
+    std::string key = MakeKey(input);
+
+    Remember(key, result);
+    counters.stores++;
+    if(directory.empty()) return;
+
+    //Write a temporary file and rename it into place, so that another MathLine sharing the store never reads half an entry.
+    std::string path = PathFor(key);
+    std::string temporary = path + "." + std::to_string(getpid());
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file << key.size() << '\n';
+        file.write(key.data(), (std::streamsize)key.size());
+        file.write(result.data(), (std::streamsize)result.size());
+        if(!file){
+            file.close();
+            std::remove(temporary.c_str());
+            return;
+        }
+    }
+    if(std::rename(temporary.c_str(), path.c_str()) != 0) std::remove(temporary.c_str());
+}
+
+void ResultCache::Invalidate(std::string_view input){
+    std::string key = MakeKey(input);
+
+    auto found = entries.find(key);
+    if(found != entries.end()){
+        order.erase(found->second.position);
+        entries.erase(found);
+    }
+    if(!directory.empty()) std::remove(PathFor(key).c_str());
+}
+
+void ResultCache::Clear(){
+    entries.clear();
+    order.clear();
+    if(directory.empty()) return;
+
+    DIR *store = opendir(directory.c_str());
+    if(store == nullptr) return;
+    std::string extension = resultExtension;
+    while(dirent *entry = readdir(store)){
+        std::string name = entry->d_name;
+        if(name.size() > extension.size() && name.compare(name.size() - extension.size(), extension.size(), extension) == 0){
+            std::remove((directory + name).c_str());
+        }
+    }
+    closedir(store);
+}
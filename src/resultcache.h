@@ -0,0 +1,72 @@
+//
+//  resultcache.h
+//  MathLinkBridge
+//
+//  Remembers the results of evaluations so that evaluating the same input
+//  again doesn't have to involve the kernel. Only use it for inputs that are
+//  pure, that is, whose result depends on nothing but the input: the cache
+//  has no way of knowing that f[x] means something else now that f has been
+//  redefined. IsCacheable() turns away the inputs that obviously aren't.
+//
+//  Entries are keyed by the input, normalized so that differences in
+//  whitespace and comments don't matter, and by the kernel's $Version, so
+//  that a different kernel never sees another's results. With a directory,
+//  entries are also kept on disk, one file each, and survive from one run to
+//  the next.
+//
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <list>
+
+class ResultCache{
+public:
+    //The number of hits, misses and new entries since the cache was made.
+    struct Counters{
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t stores = 0;
+    };
+
+    //directory, which must exist, holds the on-disk store. Empty keeps everything in memory. At most maxEntries are kept in memory; the oldest go first.
+    explicit ResultCache(std::string directory = "", size_t maxEntries = 100000);
+
+    //Entries made with one kernel version are invisible with another.
+    void SetKernelVersion(std::string version);
+
+    //Returns whether there is a result for input, and if so, puts it in result.
+    bool Lookup(std::string_view input, std::string &result);
+    void Store(std::string_view input, std::string_view result);
+    //Forgets the result for input, on disk too.
+    void Invalidate(std::string_view input);
+    //Forgets everything, on disk too, for every kernel version.
+    void Clear();
+
+    const Counters &GetCounters() const { return counters; }
+
+    //Collapses whitespace and drops comments outside of strings, so that "f[ x ]  (* again *)" and "f[x]" are the same input.
+    static std::string Normalize(std::string_view input);
+    //Whether input may be cached: false if it assigns (x = 1, f[x_] := x, i++, x += 2, Set[x, 1], ...), has side effects (Print, Put, Get, Export, ...), depends on the time, the random state or the session ($Line, %, Now, RandomReal, ...). Errs on the side of false, e.g. for SetPrecision.
+    static bool IsCacheable(std::string_view input);
+
+private:
+    std::string directory;
+    size_t maxEntries;
+    std::string kernelVersion;
+    //Keys in the order they were added, for eviction.
+    std::list<std::string> order;
+    struct Entry{
+        std::string result;
+        //Where the key is in order, so that Invalidate() can take it out.
+        std::list<std::string>::iterator position;
+    };
+    std::unordered_map<std::string, Entry> entries;
+    Counters counters;
+
+    std::string MakeKey(std::string_view input) const;
+    std::string PathFor(const std::string &key) const;
+    void Remember(const std::string &key, std::string_view result);
+};
@@ -0,0 +1,172 @@
+//
+//  scanner.cpp
+//  MathLinkBridge
+//
+
+#include <string>
+#include <algorithm>
+
+#include "scanner.h"
+
+void ExpressionScanner::Reset(){
+    *this = ExpressionScanner();
+}
+
+void ExpressionScanner::Feed(std::string_view text){
+    for(char c : text){
+        if(inString){
+            if(escaped){
+                escaped = false;
+            } else if(c == '\\'){
+                escaped = true;
+            } else if(c == '"'){
+                inString = false;
+                beforeLast = last;
+                last = c;
+                lastJoined = false;
+            }
+            previous = c;
+            continue;
+        }
+
+        if(commentDepth > 0){
+            if(c == '*' && previous == '('){
+                commentDepth++;
+                //So that "(*)" doesn't close the comment it just opened.
+                c = 0;
+            } else if(c == ')' && previous == '*'){
+                commentDepth--;
+                c = 0;
+            }
+            previous = c;
+            continue;
+        }
+
+        switch(c){
+            case ' ': case '\t': case '\r': case '\n':
+                previous = c;
+                continue;
+            case '"':
+                inString = true;
+                break;
+            case '(': case '[': case '{':
+                depth++;
+                break;
+            case ')': case ']': case '}':
+                depth--;
+                break;
+            case '*':
+                if(previous == '('){
+                    //That '(' opened a comment, not an expression. Restore what came before it.
+                    depth--;
+                    commentDepth = 1;
+                    last = savedLast;
+                    beforeLast = savedBeforeLast;
+                    lastJoined = savedLastJoined;
+                    sawCode = savedSawCode;
+                    previous = 0;
+                    continue;
+                }
+                break;
+            case '|':
+                if(previous == '<') depth++;
+                break;
+            case '>':
+                if(previous == '|') depth--;
+                break;
+            default:
+                break;
+        }
+
+        if(c == '('){
+            //Remember enough to undo this if it turns out to start a comment.
+            savedLast = last;
+            savedBeforeLast = beforeLast;
+            savedLastJoined = lastJoined;
+            savedSawCode = sawCode;
+        }
+        sawCode = true;
+        //previous equals last only if last came right before c: whitespace is never last, and the end of a comment leaves previous 0.
+        lastJoined = previous != 0 && previous == last;
+        beforeLast = last;
+        last = c;
+        previous = c;
+    }
+}
+
+bool ExpressionScanner::IsComplete() const {
+    if(inString || commentDepth > 0 || depth > 0) return false;
+
+    //A trailing binary operator means the expression continues on the next line.
+    switch(last){
+        case '+':
+            //x++ is complete; x + + is not.
+            return beforeLast == '+' && lastJoined;
+        case '-':
+            //x-- is complete; x - - is not.
+            return beforeLast == '-' && lastJoined;
+        case '.':
+            //A number like 1. is complete, and so are x =. and the optional pattern x_. Otherwise it is /., //. or Dot.
+            return (beforeLast >= '0' && beforeLast <= '9') || beforeLast == '=' || beforeLast == '_';
+        case '>':
+            //An association's closing |> is complete; -> and > are not.
+            return beforeLast == '|';
+        case '&':
+            //A pure function's & is complete; && is not.
+            return beforeLast != '&';
+        case '*': case '/': case '^': case '=': case '<':
+        case '|': case '@': case ':': case '~': case ',': case '\\': case '?':
+            return false;
+        default:
+            return true;
+    }
+}
+
+bool ReadExpression(std::istream &in, std::string &expression){
+    ExpressionScanner scanner;
+    std::string line;
+
+    expression.clear();
+    while(std::getline(in, line)){
+        if(!expression.empty()) expression.push_back('\n');
+        expression.append(line);
+        scanner.Feed(line);
+        scanner.Feed("\n");
+
+        if(scanner.IsComplete()){
+            //Skip lines with nothing but whitespace and comments.
+            if(!scanner.IsEmpty()) return true;
+            expression.clear();
+            scanner.Reset();
+        }
+    }
+
+    //Whatever is left over at the end of the input is the kernel's problem.
+    return !scanner.IsEmpty();
+}
+
+bool NextExpression(std::string_view text, size_t &offset, std::string_view &expression){
+    ExpressionScanner scanner;
+    size_t start = offset;
+    size_t lineEnd = offset;
+
+    while(offset < text.size()){
+        lineEnd = text.find('\n', offset);
+        if(lineEnd == std::string_view::npos) lineEnd = text.size();
+        //The line and its newline, if it has one.
+        scanner.Feed(text.substr(offset, lineEnd + 1 - offset));
+        if(lineEnd == text.size()) scanner.Feed("\n");
+        offset = std::min(lineEnd + 1, text.size());
+
+        if(scanner.IsComplete()){
+            //Skip lines with nothing but whitespace and comments.
+            if(!scanner.IsEmpty()) break;
+            start = offset;
+            scanner.Reset();
+        }
+    }
+
+    //As with ReadExpression, the expression doesn't include the newline that ends it.
+    expression = text.substr(start, lineEnd - start);
+    return !scanner.IsEmpty();
+}
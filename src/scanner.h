@@ -0,0 +1,54 @@
+//
+//  scanner.h
+//  MathLinkBridge
+//
+//  Decides whether Mathematica input forms complete expressions without
+//  asking the kernel. It tracks brackets, strings, nested comments and
+//  trailing binary operators. Input is fed in pieces as it arrives, and the
+//  scanner keeps its state between pieces so that every byte is looked at
+//  exactly once.
+//
+//  This is a heuristic, not a parser. It is used to find expression
+//  boundaries; the kernel remains the final judge of syntax.
+//
+
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <istream>
+
+class ExpressionScanner{
+public:
+    void Feed(std::string_view text);
+    //True if everything fed so far could be sent to the kernel as is.
+    bool IsComplete() const;
+    //True if nothing but whitespace and comments has been fed.
+    bool IsEmpty() const { return !sawCode; }
+    void Reset();
+
+private:
+    //Open (, [, { and <| minus the closing ones.
+    int depth = 0;
+    //Comments nest.
+    int commentDepth = 0;
+    bool inString = false;
+    bool escaped = false;
+    //The previous byte, whatever it was. Used to spot two-character tokens like (* and |>.
+    char previous = 0;
+    //The last two significant bytes outside of strings and comments, and whether nothing came between them, which tells x++ from x+ +.
+    char last = 0;
+    char beforeLast = 0;
+    bool lastJoined = false;
+    bool sawCode = false;
+    //The state before the last '(', in case it turns out to open a comment.
+    char savedLast = 0;
+    char savedBeforeLast = 0;
+    bool savedLastJoined = false;
+    bool savedSawCode = false;
+};
+
+//Reads lines from in until they form a complete expression, skipping lines with nothing but whitespace and comments. Returns false at end of input.
+bool ReadExpression(std::istream &in, std::string &expression);
+//Like ReadExpression, but finds the next expression in text, starting at offset, without copying it. expression is a slice of text. offset is advanced past it.
+bool NextExpression(std::string_view text, size_t &offset, std::string_view &expression);
@@ -0,0 +1,64 @@
+//
+//  tracer.cpp
+//  MathLinkBridge
+//
+
+#include <cstdio>
+
+#include <unistd.h>
+
+#include "tracer.h"
+#include "jsonrecord.h"
+
+EvaluationTracer::EvaluationTracer(size_t capacity):
+    events(capacity > 0 ? capacity : 1),
+    epoch(Clock::now()){
+    //Pass.
+}
+
+void EvaluationTracer::Record(const Event &event){
+    events[recorded % events.size()] = event;
+    recorded++;
+}
+
+void EvaluationTracer::Complete(const char *name, Clock::time_point start, Clock::time_point end, uint64_t evaluation){
+    Record(Event{name, start, end, evaluation, false});
+}
+
+void EvaluationTracer::Instant(const char *name, Clock::time_point time, uint64_t evaluation){
+    Record(Event{name, time, time, evaluation, true});
+}
+
+//Trace event timestamps are in microseconds. We keep nanosecond precision.
+static void WriteMicroseconds(std::ostream &out, std::chrono::nanoseconds duration){
+    char buffer[32];
+    long long nanoseconds = (long long)duration.count();
+    std::snprintf(buffer, sizeof buffer, "%lld.%03lld", nanoseconds / 1000, (nanoseconds < 0 ? -nanoseconds : nanoseconds) % 1000);
+    out << buffer;
+}
+
+void EvaluationTracer::WriteJSON(std::ostream &out) const{
+    uint64_t kept = recorded < events.size() ? recorded : events.size();
+    int pid = (int)getpid();
+
+    out << "{\"traceEvents\":[";
+    //Oldest first.
+    for(uint64_t i = recorded - kept; i < recorded; i++){
+        const Event &event = events[i % events.size()];
+        if(i > recorded - kept) out << ",";
+        out << "\n{\"name\":\"";
+        JSONRecord::WriteEscaped(out, event.name);
+        out << "\",\"cat\":\"mathline\",\"ph\":\"" << (event.instant ? "i" : "X") << "\",\"ts\":";
+        WriteMicroseconds(out, event.start - epoch);
+        if(event.instant){
+            out << ",\"s\":\"t\"";
+        } else{
+            out << ",\"dur\":";
+            WriteMicroseconds(out, event.end - event.start);
+        }
+        out << ",\"pid\":" << pid << ",\"tid\":1";
+        if(event.evaluation > 0) out << ",\"args\":{\"evaluation\":" << event.evaluation << "}";
+        out << "}";
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":" << Dropped() << "}}\n";
+}
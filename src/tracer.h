@@ -0,0 +1,76 @@
+//
+//  tracer.h
+//  MathLinkBridge
+//
+//  Records where the time goes in each evaluation as a timeline of spans:
+//  reading the input, sending it, waiting for each packet and handling it,
+//  printing messages. The timeline is written out in the Chrome trace event
+//  format, which chrome://tracing and ui.perfetto.dev both open.
+//
+//  Spans go into a ring buffer allocated up front. Recording one is a clock
+//  read and a store, so tracing is cheap enough to leave on. When the buffer
+//  is full the oldest spans are overwritten. Span names are never copied;
+//  they must be string literals or otherwise outlive the tracer.
+//
+//  A tracer is not thread safe. It belongs to the thread driving the
+//  MLBridge.
+//
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+class EvaluationTracer{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    //capacity is the number of spans kept.
+    explicit EvaluationTracer(size_t capacity = 1 << 16);
+
+    //A span from start to end, belonging to the given evaluation (0 for none).
+    void Complete(const char *name, Clock::time_point start, Clock::time_point end, uint64_t evaluation);
+    //A moment in time.
+    void Instant(const char *name, Clock::time_point time, uint64_t evaluation);
+
+    //Writes everything still in the buffer as a Chrome trace event JSON object.
+    void WriteJSON(std::ostream &out) const;
+    //The number of spans overwritten because the buffer was full.
+    uint64_t Dropped() const { return recorded > events.size() ? recorded - events.size() : 0; }
+
+private:
+    struct Event{
+        const char *name;
+        Clock::time_point start;
+        Clock::time_point end;
+        uint64_t evaluation;
+        bool instant;
+    };
+    std::vector<Event> events;
+    uint64_t recorded = 0;
+    //Timestamps are written relative to this.
+    Clock::time_point epoch;
+
+    void Record(const Event &event);
+};
+
+//Records a span from construction to destruction, if there is a tracer.
+class TraceSpan{
+public:
+    TraceSpan(EvaluationTracer *tracer, const char *name, uint64_t evaluation):
+        tracer(tracer), name(name), evaluation(evaluation),
+        start(tracer ? EvaluationTracer::Clock::now() : EvaluationTracer::Clock::time_point()) {}
+    ~TraceSpan(){
+        if(tracer) tracer->Complete(name, start, EvaluationTracer::Clock::now(), evaluation);
+    }
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+    EvaluationTracer *tracer;
+    const char *name;
+    uint64_t evaluation;
+    EvaluationTracer::Clock::time_point start;
+};
@@ -0,0 +1,191 @@
+//
+//  wstplink.cpp
+//  MathLinkBridge
+//
+//  Note: Functions with an MMA- prefix are really MathLink/WSTP functions.
+//        The correct prefix (ML- or WS-) is determined at compile time with
+//        a macro. See config.h for details.
+
+#include "wstplink.h"
+
+//MMAWaitForLinkActivityWithCallback does not give us a way to pass our own state to the callback, so we stash it here for the duration of the wait. Each thread may be waiting on its own link.
+static thread_local ILink::AbortCallback currentAbortCallback;
+
+static int WaitCallback(MMALINK, void *){
+    return currentAbortCallback() ? 1 : 0;
+}
+
+
+WSTPLink::~WSTPLink(){
+    Close();
+}
+
+int WSTPLink::Open(int argc, const char *argv[]){
+    int error = MMAEOK;
+
+    //Initialize the library.
+    environment = MMAInitialize(nullptr);
+    if(environment == nullptr) return MMAEDEAD;
+
+    //Open the link to Mathematica.
+    link = MMAOpenArgcArgv(environment, argc, (char **)argv, &error);
+    if(link == nullptr || error != MMAEOK){
+        //The link failed to open.
+        link = nullptr;
+        MMADeinitialize(environment);
+        environment = nullptr;
+        return error == MMAEOK ? MMAEDEAD : error;
+    }
+    return MMAEOK;
+}
+
+int WSTPLink::Activate(){
+    return MMAActivate(link);
+}
+
+void WSTPLink::Close(){
+    if(link){
+        MMAClose(link);
+        link = nullptr;
+    }
+    if(environment){
+        MMADeinitialize(environment);
+        environment = nullptr;
+    }
+}
+
+ILink::WaitResult WSTPLink::WaitForLinkActivity(AbortCallback abort){
+    int result;
+
+    if(!abort){
+        return MMAWaitForLinkActivity(link) == MMAWAITSUCCESS ? WaitSuccess : WaitError;
+    }
+
+    currentAbortCallback = abort;
+    result = MMAWaitForLinkActivityWithCallback(link, WaitCallback);
+    currentAbortCallback = nullptr;
+
+    if(result == MMAWAITSUCCESS) return WaitSuccess;
+    if(result == MMAWAITCALLBACKABORTED) return WaitAborted;
+    return WaitError;
+}
+
+int WSTPLink::Ready(){
+    return MMAReady(link);
+}
+
+int WSTPLink::NextPacket(){
+    return MMANextPacket(link);
+}
+
+int WSTPLink::NewPacket(){
+    return MMANewPacket(link);
+}
+
+int WSTPLink::GetUTF8String(const unsigned char **string, int *bytes, int *characters){
+    return MMAGetUTF8String(link, string, bytes, characters);
+}
+
+int WSTPLink::GetUTF8Symbol(const unsigned char **string, int *bytes, int *characters){
+    return MMAGetUTF8Symbol(link, string, bytes, characters);
+}
+
+void WSTPLink::ReleaseUTF8String(const unsigned char *string, int bytes){
+    MMAReleaseUTF8String(link, string, bytes);
+}
+
+int WSTPLink::GetUTF8Characters(int *remaining, unsigned char *buffer, int capacity, int *bytes, int *characters){
+    return MMAGetUTF8Characters(link, remaining, buffer, capacity, bytes, characters);
+}
+
+int WSTPLink::GetInteger(int *integer){
+    return MMAGetInteger(link, integer);
+}
+
+int WSTPLink::GetNext(){
+    return MMAGetNext(link);
+}
+
+int WSTPLink::GetArgCount(int *count){
+    return MMAGetArgCount(link, count);
+}
+
+int WSTPLink::GetInteger64(long long *integer){
+    MMAINT64 value;
+    if(!MMAGetInteger64(link, &value)) return 0;
+    *integer = (long long)value;
+    return 1;
+}
+
+int WSTPLink::GetReal64(double *real){
+    return MMAGetReal64(link, real);
+}
+
+//MMAINT64 is long on some platforms and long long on others, but it is always 64 bits.
+static_assert(sizeof(MMAINT64) == sizeof(long long), "The link's 64 bit integers must be long long sized.");
+
+int WSTPLink::GetArray(double **data, int **dimensions, char ***heads, int *depth){
+    return MMAGetReal64Array(link, data, dimensions, heads, depth);
+}
+
+int WSTPLink::GetArray(long long **data, int **dimensions, char ***heads, int *depth){
+    return MMAGetInteger64Array(link, (MMAINT64 **)data, dimensions, heads, depth);
+}
+
+void WSTPLink::ReleaseArray(double *data, int *dimensions, char **heads, int depth){
+    MMAReleaseReal64Array(link, data, dimensions, heads, depth);
+}
+
+void WSTPLink::ReleaseArray(long long *data, int *dimensions, char **heads, int depth){
+    MMAReleaseInteger64Array(link, (MMAINT64 *)data, dimensions, heads, depth);
+}
+
+int WSTPLink::PutSymbol(const char *symbol){
+    return MMAPutSymbol(link, symbol);
+}
+
+//Passing no heads makes every level a List.
+int WSTPLink::PutArray(const double *data, const int *dimensions, int depth){
+    return MMAPutReal64Array(link, data, dimensions, nullptr, depth);
+}
+
+int WSTPLink::PutArray(const long long *data, const int *dimensions, int depth){
+    return MMAPutInteger64Array(link, (const MMAINT64 *)data, dimensions, nullptr, depth);
+}
+
+int WSTPLink::PutFunction(const char *head, int argCount){
+    return MMAPutFunction(link, head, argCount);
+}
+
+int WSTPLink::PutUTF8String(const unsigned char *string, int bytes){
+    return MMAPutUTF8String(link, string, bytes);
+}
+
+int WSTPLink::EndPacket(){
+    return MMAEndPacket(link);
+}
+
+int WSTPLink::Flush(){
+    return MMAFlush(link);
+}
+
+int WSTPLink::PutInterruptMessage(){
+    return MMAPutMessage(link, MMAInterruptMessage);
+}
+
+int WSTPLink::Error(){
+    if(link == nullptr) return MMAEDEAD;
+    return MMAError(link);
+}
+
+std::string WSTPLink::ErrorMessage(){
+    std::string error;
+
+    if(link == nullptr) return "The " MMANAME " connection has been severed.";
+    const char *errormsg = MMAErrorMessage(link);
+    if(errormsg){
+        error = std::string(errormsg);
+        MMAReleaseErrorMessage(link, errormsg);
+    }
+    return error;
+}
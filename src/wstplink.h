@@ -0,0 +1,54 @@
+//
+//  wstplink.h
+//  MathLinkBridge
+//
+//  An ILink backed by the MathLink/WSTP library. This is the link MLBridge
+//  uses unless it is handed a different one.
+//
+
+#pragma once
+
+#include "link.h"
+
+class WSTPLink: public ILink {
+public:
+    ~WSTPLink() override;
+
+    int Open(int argc, const char *argv[]) override;
+    int Activate() override;
+    void Close() override;
+
+    WaitResult WaitForLinkActivity(AbortCallback abort = nullptr) override;
+    int Ready() override;
+    int NextPacket() override;
+    int NewPacket() override;
+    int GetUTF8String(const unsigned char **string, int *bytes, int *characters) override;
+    int GetUTF8Symbol(const unsigned char **string, int *bytes, int *characters) override;
+    void ReleaseUTF8String(const unsigned char *string, int bytes) override;
+    int GetUTF8Characters(int *remaining, unsigned char *buffer, int capacity, int *bytes, int *characters) override;
+    int GetInteger(int *integer) override;
+    int GetNext() override;
+    int GetArgCount(int *count) override;
+    int GetInteger64(long long *integer) override;
+    int GetReal64(double *real) override;
+    int GetArray(double **data, int **dimensions, char ***heads, int *depth) override;
+    int GetArray(long long **data, int **dimensions, char ***heads, int *depth) override;
+    void ReleaseArray(double *data, int *dimensions, char **heads, int depth) override;
+    void ReleaseArray(long long *data, int *dimensions, char **heads, int depth) override;
+
+    int PutFunction(const char *head, int argCount) override;
+    int PutUTF8String(const unsigned char *string, int bytes) override;
+    int PutSymbol(const char *symbol) override;
+    int PutArray(const double *data, const int *dimensions, int depth) override;
+    int PutArray(const long long *data, const int *dimensions, int depth) override;
+    int EndPacket() override;
+    int Flush() override;
+    int PutInterruptMessage() override;
+
+    int Error() override;
+    std::string ErrorMessage() override;
+
+private:
+    MMALINK link = nullptr;
+    MMAEnvironment environment = nullptr;
+};
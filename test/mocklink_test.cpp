@@ -0,0 +1,188 @@
+//
+//  mocklink_test.cpp
+//  MathLinkBridge
+//
+//  Replays MockScripts through MLBridge and checks what comes out: the output
+//  of EvaluateTo() in both protocols, the inputs Batch() sends the kernel, the
+//  results EvaluateAsync() hands back, and what happens when the kernel dies.
+//  Exits nonzero if any check fails.
+//
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <future>
+
+#include "mlbridge.h"
+#include "mocklink.h"
+
+static int failures = 0;
+
+static void Check(bool condition, const std::string &what){
+    if(condition) return;
+    std::cerr << "FAILED: " << what << std::endl;
+    failures++;
+}
+
+//Answers the $PrePrint request Connect() makes, then every input with 42.
+static const char *answers = R"(
+INPUTNAMEPKT "In[1]:= "
+---
+RETURNPKT "InputForm"
+loop
+---
+OUTPUTNAMEPKT "Out[1]= "
+RETURNTEXTPKT "42"
+INPUTNAMEPKT "In[2]:= "
+)";
+
+static const char *messages = R"(
+INPUTNAMEPKT "In[1]:= "
+---
+RETURNPKT "InputForm"
+loop
+---
+MESSAGEPKT Power "infy"
+TEXTPKT "Power::infy: Infinite expression 1/0 encountered."
+OUTPUTNAMEPKT "Out[1]= "
+RETURNTEXTPKT "ComplexInfinity"
+INPUTNAMEPKT "In[2]:= "
+)";
+
+//Answers evaluations outside of the Main Loop, as EvaluateAsync() sends them.
+static const char *returns = R"(
+INPUTNAMEPKT "In[1]:= "
+---
+RETURNPKT "InputForm"
+loop
+---
+MESSAGEPKT Power "infy"
+TEXTPKT "Power::infy: Infinite expression."
+RETURNPKT "42"
+)";
+
+//Gets through Connect(), then the link goes away.
+static const char *dies = R"(
+INPUTNAMEPKT "In[1]:= "
+---
+RETURNPKT "InputForm"
+)";
+
+static MockScript Script(const char *text){
+    std::istringstream in(text);
+    return MockScript::Parse(in);
+}
+
+//An MLBridge talking to a MockLink that plays script. link is left pointing at the MockLink, which the MLBridge owns.
+static std::unique_ptr<MLBridge> Bridge(const char *script, MockLink::Transport transport, MockLink *&link){
+    link = new MockLink(Script(script), transport);
+    std::unique_ptr<MLBridge> bridge(new MLBridge(std::unique_ptr<ILink>(link)));
+    bridge->handleInterrupts = false;
+    return bridge;
+}
+
+//The inputs the kernel was sent with EnterTextPacket, in order.
+static std::vector<std::string> Inputs(MockLink *link){
+    std::vector<std::string> inputs;
+    for(auto &request : link->Kernel().Requests()){
+        if(request.type == ENTERTEXTPKT && !request.tokens.empty()) inputs.push_back(request.tokens.back().text);
+    }
+    return inputs;
+}
+
+static void CheckEvaluateTo(MockLink::Transport transport, const std::string &name){
+    MockLink *link;
+    auto bridge = Bridge(answers, transport, link);
+    bridge->Connect();
+    std::ostringstream out;
+    bridge->EvaluateTo("6*7", out);
+    Check(out.str() == "\nOut[1]= \n42\n\n", "EvaluateTo prints the result over " + name);
+    Check(Inputs(link) == std::vector<std::string>{"6*7"}, "EvaluateTo sends the input over " + name);
+
+    bridge = Bridge(messages, transport, link);
+    bridge->Connect();
+    out.str("");
+    bridge->EvaluateTo("1/0", out);
+    Check(out.str() == "\nPower::infy: Infinite expression 1/0 encountered.\n\nOut[1]= \nComplexInfinity\n\n", "EvaluateTo prints messages over " + name);
+
+    bridge = Bridge(messages, transport, link);
+    bridge->protocol = MLBridge::JSONLinesProtocol;
+    bridge->Connect();
+    out.str("");
+    bridge->EvaluateTo("1/0", out);
+    Check(out.str() ==
+        "{\"type\":\"message\",\"name\":\"Power\",\"tag\":\"infy\",\"text\":\"Power::infy: Infinite expression 1/0 encountered.\"}\n"
+        "{\"type\":\"outputname\",\"text\":\"Out[1]= \"}\n"
+        "{\"type\":\"return\",\"text\":\"ComplexInfinity\"}\n", "EvaluateTo writes JSON Lines over " + name);
+}
+
+static void CheckBatch(){
+    const char *text = "expr /.\n  {a -> 1}\nx - -\ny\n(* a comment *)\nnext\n";
+    const std::vector<std::string> expected{"expr /.\n  {a -> 1}", "x - -\ny", "next"};
+
+    MockLink *link;
+    auto bridge = Bridge(answers, MockLink::InProcess, link);
+    std::ostringstream out;
+    bridge->pcout = &out;
+    bridge->Connect();
+    std::istringstream in(text);
+    bridge->Batch(in);
+    Check(Inputs(link) == expected, "Batch(istream) sends each multi-line expression whole");
+    Check(out.str().find("In[1]:= expr /.\n  {a -> 1}\nOut[1]= \n42\n") != std::string::npos, "Batch(istream) prints each input with its output");
+
+    bridge = Bridge(answers, MockLink::SocketPair, link);
+    out.str("");
+    bridge->pcout = &out;
+    bridge->Connect();
+    bridge->Batch(std::string_view(text));
+    Check(Inputs(link) == expected, "Batch(text) sends each multi-line expression whole");
+}
+
+static void CheckEvaluateAsync(){
+    MockLink *link;
+    auto bridge = Bridge(returns, MockLink::SocketPair, link);
+    bridge->Connect();
+    std::vector<std::future<std::string>> results;
+    for(int i = 0; i < 20; i++) results.push_back(bridge->EvaluateAsync("f[" + std::to_string(i) + "]"));
+    bool all = true;
+    for(auto &result : results) all = all && result.get() == "42";
+    Check(all, "EvaluateAsync hands every result to its future");
+
+    bridge = Bridge(dies, MockLink::InProcess, link);
+    bridge->Connect();
+    auto result = bridge->EvaluateAsync("1");
+    bool threw = false;
+    try {
+        result.get();
+    } catch (MLBridgeException &) {
+        threw = true;
+    }
+    Check(threw, "EvaluateAsync hands a dead link's error to the future");
+}
+
+static void CheckDeadKernel(){
+    MockLink *link;
+    auto bridge = Bridge(dies, MockLink::InProcess, link);
+    bridge->Connect();
+    std::ostringstream out;
+    bool threw = false;
+    try {
+        bridge->EvaluateTo("1", out);
+    } catch (MLBridgeException &) {
+        threw = true;
+    }
+    Check(threw, "EvaluateTo throws when the kernel dies");
+    Check(!bridge->IsConnected(), "a dead kernel leaves the bridge disconnected");
+}
+
+int main(){
+    CheckEvaluateTo(MockLink::InProcess, "an in-process link");
+    CheckEvaluateTo(MockLink::SocketPair, "a socketpair");
+    CheckBatch();
+    CheckEvaluateAsync();
+    CheckDeadKernel();
+
+    if(failures == 0) std::cout << "All mock link checks passed." << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+//
+//  scanner_test.cpp
+//  MathLinkBridge
+//
+//  Checks where ExpressionScanner, ReadExpression and NextExpression split
+//  input into expressions. Exits nonzero if any check fails.
+//
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "scanner.h"
+
+static int failures = 0;
+
+static void Check(bool condition, const std::string &what){
+    if(condition) return;
+    std::cerr << "FAILED: " << what << std::endl;
+    failures++;
+}
+
+static bool Complete(const std::string &input){
+    ExpressionScanner scanner;
+    scanner.Feed(input);
+    scanner.Feed("\n");
+    return scanner.IsComplete();
+}
+
+//The expressions ReadExpression finds in text. NextExpression must find the same ones.
+static std::vector<std::string> Split(const std::string &text){
+    std::vector<std::string> expressions;
+    std::istringstream in(text);
+    std::string expression;
+
+    while(ReadExpression(in, expression)) expressions.push_back(expression);
+
+    size_t offset = 0;
+    std::string_view slice;
+    std::vector<std::string> sliced;
+    while(NextExpression(text, offset, slice)) sliced.emplace_back(slice);
+    Check(sliced == expressions, "NextExpression agrees with ReadExpression on " + text);
+    return expressions;
+}
+
+int main(){
+    const char *complete[] = {
+        "1 + 2", "x++", "x--", "f[x]", "<|a -> 1|>", "#^2 &", "1.", "x = 3.", "x =.", "f[x_.]", "x_.", "\"a +\"", "x (* y + *)",
+        "{1, 2}", "a.b", "x(**)--",
+    };
+    const char *incomplete[] = {
+        "1 +", "x -", "x - -", "x + +", "a &&", "x ->", "f[x", "\"abc", "(* comment", "x /.", "x //.", "a .", "a.", "x_?",
+        "x :=", "a ~~", "f @", "x ==", "a ||", "x -(**)-",
+    };
+
+    for(const char *input : complete) Check(Complete(input), std::string("complete: ") + input);
+    for(const char *input : incomplete) Check(!Complete(input), std::string("incomplete: ") + input);
+
+    Check(Split("expr /.\n  {a -> 1}\nnext") == std::vector<std::string>{"expr /.\n  {a -> 1}", "next"}, "ReplaceAll over two lines");
+    Check(Split("x //.\n  rules\n") == std::vector<std::string>{"x //.\n  rules"}, "ReplaceRepeated over two lines");
+    Check(Split("a .\nb\nc") == std::vector<std::string>{"a .\nb", "c"}, "Dot over two lines");
+    Check(Split("f[x_?\nIntegerQ] := x\n") == std::vector<std::string>{"f[x_?\nIntegerQ] := x"}, "PatternTest over two lines");
+    Check(Split("x = 1.\ny\n") == std::vector<std::string>{"x = 1.", "y"}, "a number ending in a point");
+    Check(Split("x - -\ny\nz") == std::vector<std::string>{"x - -\ny", "z"}, "minus minus with a space");
+    Check(Split("(* only a comment *)\n\n1 + 1\n") == std::vector<std::string>{"1 + 1"}, "comment lines are skipped");
+
+    if(failures == 0) std::cout << "All scanner checks passed." << std::endl;
+    return failures == 0 ? 0 : 1;
+}